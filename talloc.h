@@ -2,8 +2,13 @@
 #define __TALLOC_H__
 
 #include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <sys/mman.h>
+#include <time.h>
+#include <errno.h>
 
 #if UINTPTR_MAX == UINT64_MAX
     #define TALLOC_MAGIC 0xab91ea94be7fcc2aULL
@@ -11,170 +16,2273 @@
     #define TALLOC_MAGIC 0xab91ea94 // magic for integrity checking
 #endif
 
-#define TALLOC_ALLOC_PAGES 1000 // how many pages to allocate per arena
+#define TALLOC_ALLOC_PAGES 1000 // how many pages to allocate per arena, once the heap has grown
+#define TALLOC_FIRST_ARENA_PAGES 16 // how many pages the first mapped arena has; each new one doubles that
+#define TALLOC_BOOTSTRAP_ARENAS 64 // how many descriptors the static descriptor table holds
+#ifndef TALLOC_BOOTSTRAP_SIZE
+	#define TALLOC_BOOTSTRAP_SIZE (64 * 1024) // size of the static arena serving the first allocations
+#endif
+#define TALLOC_TRIM_PAGES 64 // how many free pages at the end of an arena we keep before unmapping them
+
+// options for TAlloc_set_options, for heaps that must not page fault once warmed up
+#define TALLOC_OPT_POPULATE 0x1 // fault in arenas as soon as they're mapped, and don't trim them
+#define TALLOC_OPT_MLOCK 0x2 // lock arenas in memory, and don't trim them
+#define TALLOC_OPT_THP 0x4 // ask for transparent huge pages in general arenas
+#define TALLOC_OPT_NO_THP 0x8 // ask for no transparent huge pages in general arenas
+
+// Memory pressure. Once a pressure source is set, it's polled every
+// TALLOC_PRESSURE_INTERVAL calls to TAlloc_malloc and TAlloc_free.
+#define TALLOC_PRESSURE_INTERVAL 4096
+#define TALLOC_PRESSURE_AVG10 10 // PSI "some avg10" percentage from which memory counts as under pressure
+#ifdef __linux__
+	#define TALLOC_PURGE_ADVICE MADV_DONTNEED // hand free pages back right away
+#else
+	#define TALLOC_PURGE_ADVICE MADV_FREE // let the OS take free pages when it needs them
+#endif
+
+// Define TALLOC_THREADS as 1 to use the allocator from several threads. A
+// global lock then guards the heap, and each thread keeps a cache of small
+// blocks it freed, TALLOC_TCACHE_COUNT of each size class (multiples of
+// TALLOC_ALIGNMENT up to TALLOC_TCACHE_MAX bytes), which it allocates from
+// without taking the lock. Every TALLOC_TCACHE_GC_MS milliseconds, half of
+// the blocks a class didn't need since the last time go back to the heap
+// (other threads see to that for threads that went quiet), and a thread's
+// whole cache goes back when the thread exits.
+#ifndef TALLOC_THREADS
+	#define TALLOC_THREADS 0
+#endif
+#define TALLOC_TCACHE_MAX 256
+#define TALLOC_TCACHE_CLASSES (TALLOC_TCACHE_MAX / TALLOC_ALIGNMENT)
+#define TALLOC_TCACHE_COUNT 32
+#define TALLOC_TCACHE_GC_MS 1000
+#define TALLOC_TCACHE_GC_TICKS 256 // how many cache operations go by between looks at the clock
+#define TALLOC_DEPOT_MAGAZINES 64 // how many batches of blocks the depot holds per size class
+#define TALLOC_DEFER_BATCH 64 // how many deferred frees a thread collects before handing them over
+#define TALLOC_DEFER_MAX 4096 // past this many waiting for the reclaimer, threads free their own
+#define TALLOC_DEFER_MS 100 // how long a thread's deferred frees wait before the reclaimer takes them anyway
+
+// Define TALLOC_LOCK_STATS as 1 to count how often the lock is taken, how
+// often threads had to wait for it, and for how long (see TAlloc_stats).
+#ifndef TALLOC_LOCK_STATS
+	#define TALLOC_LOCK_STATS 0
+#endif
+
+// Contention counters of a lock.
+typedef struct __talloc_lock_stats_t {
+	uint64_t acquisitions; // how many times the lock was taken
+	uint64_t contended; // how many of those had to wait for another thread
+	uint64_t spins; // how many times waiting threads spun
+	uint64_t wait_ns; // how long threads waited in total, in nanoseconds
+} talloc_lock_stats_t;
+
+// The heap lock spins for a while before it puts a thread to sleep, since
+// it's only ever held for a short time. How long it spins adapts to how
+// long threads end up waiting for it, between these bounds (in spins).
+#define TALLOC_SPIN_MIN 16
+#define TALLOC_SPIN_MAX 2048
+#define TALLOC_SPIN_INITIAL 128
+
+#if TALLOC_THREADS
+#include <pthread.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+typedef struct __talloc_lock_t {
+#ifdef __linux__
+	int word; // 0 if free, 1 if taken, 2 if taken and someone may be sleeping on it
+#else
+	pthread_mutex_t mutex; // there's no futex, so sleeping is left to pthreads
+#endif
+	int spin_limit; // how many times to spin before sleeping
+#if TALLOC_LOCK_STATS
+	talloc_lock_stats_t stats; // only updated with the lock held
+#endif
+} talloc_lock_t;
+#ifdef __linux__
+#define TALLOC_LOCK_INITIALIZER { .word = 0, .spin_limit = TALLOC_SPIN_INITIAL }
+#else
+#define TALLOC_LOCK_INITIALIZER { .mutex = PTHREAD_MUTEX_INITIALIZER, .spin_limit = TALLOC_SPIN_INITIAL }
+#endif
+#else
+#define TAlloc_lock(lock)
+#define TAlloc_unlock(lock)
+#endif
+
+// Allocation engines for general arenas, selected at compile time by
+// defining TALLOC_ENGINE before including this header.
+#define TALLOC_ENGINE_LIST 0 // address-sorted free list per arena, first fit
+#define TALLOC_ENGINE_TLSF 1 // two-level segregated fit, O(1) malloc, and O(1) free once the arena is found
+#define TALLOC_ENGINE_BINS 2 // segregated bins per arena, with a bitmap of non-empty bins
+
+#ifndef TALLOC_ENGINE
+	#define TALLOC_ENGINE TALLOC_ENGINE_LIST
+#endif
+
+// Placement policies of the list engine, selected at compile time by
+// defining TALLOC_POLICY before including this header. They decide which
+// free chunk of an arena a request is carved from.
+#define TALLOC_POLICY_FIRST_FIT 0 // the first chunk that is big enough
+#define TALLOC_POLICY_NEXT_FIT 1 // like first fit, but resume where the last search stopped, in both arenas and free lists
+#define TALLOC_POLICY_BEST_FIT 2 // the smallest chunk that is big enough
+#define TALLOC_POLICY_BOUNDED_BEST_FIT 3 // best fit, but stop at the first chunk that wastes at most 1/16 of the request
+
+#ifndef TALLOC_POLICY
+	#define TALLOC_POLICY TALLOC_POLICY_FIRST_FIT
+#endif
+
+// Arena selection policies of the list and bins engines, selected by defining
+// TALLOC_ARENA_POLICY before including this header, or with arena_policy in
+// TALLOC_CONF. They
+// decide which arena a request goes to when more than one has room for it.
+#define TALLOC_ARENA_FIRST 0 // the first arena that fits (or the next one, with next fit)
+#define TALLOC_ARENA_FULLEST 1 // the arena with the least space left that fits, so sparse arenas drain
+
+#ifndef TALLOC_ARENA_POLICY
+	#define TALLOC_ARENA_POLICY TALLOC_ARENA_FIRST
+#endif
+
+#define TALLOC_ALIGNMENT 16 // block alignment of the TLSF and bins engines
+#define TALLOC_ALIGN_UP(n) (((n) + TALLOC_ALIGNMENT - 1) & ~(size_t) (TALLOC_ALIGNMENT - 1))
+
+// Define TALLOC_COMPACT_HEADER as 1 to pack the header of allocated blocks
+// of the TLSF and bins engines into a single 8-byte word on 64-bit builds:
+// the block flags in the low bits, the payload size (a multiple of 8) above
+// them, and a 16-bit check, the top of TALLOC_MAGIC, in the top bits.
+// Blocks then start 8 bytes before a TALLOC_ALIGNMENT boundary, so payloads
+// stay aligned, and each allocation takes 8 bytes less.
+#ifndef TALLOC_COMPACT_HEADER
+	#define TALLOC_COMPACT_HEADER 0
+#endif
+#if TALLOC_COMPACT_HEADER && TALLOC_ENGINE == TALLOC_ENGINE_LIST
+	#error "TALLOC_COMPACT_HEADER needs the TLSF or the bins engine"
+#endif
+#if TALLOC_COMPACT_HEADER && UINTPTR_MAX == UINT64_MAX
+	#define TALLOC_CHECK_SHIFT 48 // where the check starts in the header word
+	#define TALLOC_CHECK_MASK (~(size_t) 0 << TALLOC_CHECK_SHIFT)
+	#define TALLOC_HEADER_MAGIC (TALLOC_MAGIC >> TALLOC_CHECK_SHIFT)
+#else
+	#define TALLOC_HEADER_MAGIC TALLOC_MAGIC
+#endif
+
+// Round a payload size up (or down) so that the block after it starts at
+// the right offset from a TALLOC_ALIGNMENT boundary.
+#define TALLOC_PAYLOAD_UP(n) (TALLOC_ALIGN_UP((n) + sizeof(talloc_header_t)) - sizeof(talloc_header_t))
+#define TALLOC_PAYLOAD_DOWN(n) ((((n) + sizeof(talloc_header_t)) & ~(size_t) (TALLOC_ALIGNMENT - 1)) - sizeof(talloc_header_t))
+
+#define TALLOC_TLSF_SL_LOG2 4 // log2 of the number of second-level lists per first-level class
+#if UINTPTR_MAX == UINT64_MAX
+	#define TALLOC_TLSF_FL_MAX 48 // log2 of the upper limit on block sizes
+#else
+	#define TALLOC_TLSF_FL_MAX 30
+#endif
+
+#define TALLOC_BINS 64 // number of bins per arena in the bins engine
+#define TALLOC_SMALL_BINS 32 // how many of them hold a single size
+#define TALLOC_BINS_SCAN 8 // how many blocks of a large bin a search looks at
+#define TALLOC_NEAR_SCAN 16 // how many blocks after the hint TAlloc_malloc_near looks at (TLSF and bins)
+
+#ifndef TALLOC_CACHE_LINE
+	#if defined(__APPLE__) && defined(__aarch64__)
+		#define TALLOC_CACHE_LINE 128 // Apple silicon has 128-byte cache lines
+	#else
+		#define TALLOC_CACHE_LINE 64
+	#endif
+#endif
+
+// Requests between TALLOC_BUDDY_MIN and TALLOC_BUDDY_MAX bytes can be served
+// by buddy arenas instead, by defining TALLOC_BUDDY as 1. Those allocations
+// are rounded up to a power-of-two number of pages, and are page aligned.
+#ifndef TALLOC_BUDDY
+	#define TALLOC_BUDDY 0
+#endif
+#define TALLOC_BUDDY_MIN 4096
+#define TALLOC_BUDDY_MAX (1 << 20) // also the size of the largest buddy block
+#define TALLOC_BUDDY_ARENA_BLOCKS 4 // how many largest blocks a buddy arena holds
+#define TALLOC_BUDDY_ORDERS 32 // upper limit on the number of block orders
+
+#define TALLOC_CTX_RUN_SIZE (64 * 1024) // size of the runs allocation contexts carve objects from
+
+#define TALLOC_SLAB_CLASSES 16 // cache-line size classes, from 1 to 16 lines
+#define TALLOC_SLAB_ARENA_PAGES 64 // how many pages to allocate per slab arena
+
+// flags for TAlloc_mallocx
+#define TALLOC_FLAG_CACHELINE 0x1 // start on a cache line, and share no cache line with other allocations
+#define TALLOC_FLAG_TAG(tag) ((tag) << 8) // charge to the given tag instead of the thread's current one
+#define TALLOC_FLAG_TAG_OF(flags) (((flags) >> 8) & 0xff)
+
+// Allocation tags. Tag 0 means untagged; the bytes allocated with every
+// other tag are counted, and can be bounded by a quota.
+#define TALLOC_TAGS 32 // number of tags, at most 256
+// Blocks waiting in a thread cache or the depot carry this magic instead of
+// the usual one, so that freeing them a second time is caught.
+#define TALLOC_CACHED_MAGIC (TALLOC_HEADER_MAGIC ^ 0x100)
+#define TALLOC_TAG_SHARDS 16 // number of copies of the tag counters, threads spread over them
+
+// arena kinds
+#define TALLOC_ARENA_GENERAL 0 // chunks managed through the free list
+#define TALLOC_ARENA_SLAB 1 // slabs of cache-line aligned objects
+#define TALLOC_ARENA_BUDDY 2 // power-of-two blocks managed by a buddy system
+
+// Define TALLOC_CHUNK_OFFSETS as 1 to have the list engine keep the size
+// and the link of free chunks as 32-bit counts of TALLOC_GRANULE bytes, the
+// link being the offset of the next free chunk from the start of the arena.
+// Free chunks then take 8 bytes instead of 16, so smaller split remainders
+// are kept, and arenas are limited to TALLOC_CHUNK_MAX_ARENA bytes.
+#ifndef TALLOC_CHUNK_OFFSETS
+	#define TALLOC_CHUNK_OFFSETS 0
+#endif
+#define TALLOC_GRANULE 8
+#define TALLOC_CHUNK_MAX_ARENA ((uint64_t) TALLOC_GRANULE << 32)
 
 // This struct represents a free chunk of memory
 // It's basically a node in a linked list of chunks
+#if TALLOC_CHUNK_OFFSETS
+typedef struct __talloc_chunk_t {
+	uint32_t size; // available size in the chunk, in granules
+	uint32_t next; // offset of the next free chunk in the arena, in granules, or 0
+} talloc_chunk_t;
+#else
 typedef struct __talloc_chunk_t {
 	size_t size; // available size in the chunk
 	struct __talloc_chunk_t *next; // next free chunk
 } talloc_chunk_t;
+#endif
 
 // This struct represents the header for an allocated
 // region of memory. This header is stored just before
 // the allocated memory we return a pointer to on allocation.
+#ifdef TALLOC_CHECK_SHIFT
+typedef struct __talloc_header_t {
+	size_t size; // size of the allocated memory, flags and check (see TALLOC_COMPACT_HEADER)
+} talloc_header_t;
+#else
 typedef struct __talloc_header_t {
 	size_t size; // size of the allocated memory
 	uintptr_t magic; // the magic field which should be equal to TALLOC_MAGIC
 } talloc_header_t;
+#endif
+
+#if TALLOC_ENGINE != TALLOC_ENGINE_LIST
+// This struct represents a block of memory in the TLSF and bins engines.
+// Blocks are kept in physical order within an arena, and each one starts
+// with a header: the payload size, with TALLOC_BLOCK_* flags in the low bits
+// (sizes are always multiples of 8), followed by the magic for allocated
+// blocks, or the next free block for free ones. The rest of
+// the struct, as well as a footer pointing back to the block, live in the
+// payload of free blocks, which is why a block is never smaller than that.
+typedef struct __talloc_block_t {
+	size_t size; // payload size and flags
+	struct __talloc_block_t *next_free; // next block in the same free list
+	struct __talloc_block_t *prev_free; // previous block in the same free list
+} talloc_block_t;
+
+#define TALLOC_BLOCK_FREE 0x1 // the block is free
+#define TALLOC_BLOCK_PREV_FREE 0x2 // the physically previous block is free
+#ifdef TALLOC_CHECK_SHIFT
+#define TALLOC_BLOCK_FLAGS (0x3 | TALLOC_CHECK_MASK) // the check goes wherever the flags go
+#else
+#define TALLOC_BLOCK_FLAGS 0x3
+#endif
+// room for the links the header doesn't hold, and the footer
+#define TALLOC_BLOCK_MIN_SIZE (sizeof(talloc_block_t) - sizeof(talloc_header_t) + sizeof(talloc_block_t *))
+#define TALLOC_BLOCK_MAX_SIZE ((size_t) 1 << (TALLOC_TLSF_FL_MAX - 1))
+#endif
 
 // This struct represents an arena. These are basically larger "chunks"
 // of memory, holding multiple smaller chunks of memory (depending on requests).
-// Total allocated space for the arena is stored in `allocated`. However, this
-// includes the space needed for this struct, as well as the space taken by
-// chunk headers (talloc_chunk_t).
+// The size of the arena and its free space are kept in its descriptor (see
+// talloc_arena_desc_t), which is found through `index`.
 // This is a linked list node, specifically a doubly linked list node, since
 // it has a pointer to the previous element.
 typedef struct __talloc_arena_t {
-	size_t allocated; // total space taken by the arena including space needed for metadata
-	size_t max_free_space; // space of the largest free chunk available
+	size_t index; // index of the arena's descriptor in state.arenas
 	talloc_chunk_t *free_list; // free chunks linked list
+#if TALLOC_POLICY == TALLOC_POLICY_NEXT_FIT
+	talloc_chunk_t *rover; // the chunk before the one the next search starts at, NULL for the head
+#endif
+#if TALLOC_ENGINE == TALLOC_ENGINE_BINS
+	// free blocks, by size: exact-size bins for small blocks, followed by
+	// two bins per power of two (the bitmap of non-empty bins is in the descriptor)
+	talloc_block_t *bins[TALLOC_BINS];
+#endif
 	struct __talloc_arena_t *next; // next arena in the list
 	struct __talloc_arena_t *prev; // previous arena in the list
+	char kind; // what the arena holds, one of TALLOC_ARENA_*
 } talloc_arena_t;
 
+// This struct describes an arena. Descriptors are not stored in the arenas,
+// but next to each other in state.arenas, so finding the arena holding a
+// pointer, or one with enough free space, is a scan over a dense array
+// rather than a walk touching a different page (and TLB entry) per arena.
+// Total allocated space for the arena is stored in `allocated`. However, this
+// includes the space needed for the arena header, as well as the space taken by
+// chunk headers (talloc_chunk_t).
+typedef struct __talloc_arena_desc_t {
+	talloc_arena_t *arena; // the arena itself, which is also where it starts
+	size_t allocated; // total space taken by the arena including space needed for metadata
+	size_t max_free_space; // space of the largest free chunk available
+	size_t used; // space taken by allocations, headers included (not kept by the TLSF engine)
+	char pinned; // is the arena kept even when it's empty? (the bootstrap and reserved arenas)
+#if TALLOC_ENGINE == TALLOC_ENGINE_BINS
+	uint64_t binmap; // bitmap of the non-empty bins of the arena
+#endif
+} talloc_arena_desc_t;
+
+// This struct describes a slab: a page holding equally sized objects of one
+// cache-line size class. The objects have no headers, and the descriptors are
+// kept at the start of the slab arena rather than in the slab itself, so an
+// object never shares a cache line with anything but itself. So are the
+// bitmaps of allocated objects, which let frees turn down objects that
+// aren't allocated.
+typedef struct __talloc_slab_t {
+	struct __talloc_slab_class_t *cls; // the size class using this slab, NULL if unused
+	void *base; // address of the first object
+	void *free_objects; // free objects linked list (the link is stored in the object)
+	size_t inuse; // number of allocated objects
+	uint64_t *allocated; // bitmap of the allocated objects, by index
+	struct __talloc_slab_t *next; // next partial slab of the class, or next unused slab of the arena
+	struct __talloc_slab_t *prev; // previous partial slab of the class
+} talloc_slab_t;
+
+// This struct represents a size class for cache-line aligned allocations.
+// Slabs of a class don't all start their first object at the same offset:
+// the slack space at the end of a slab is used to shift each new slab by one
+// more cache line (its "color"), so that the objects at the same index in
+// different slabs don't all map to the same cache sets.
+typedef struct __talloc_slab_class_t {
+	size_t size; // object size, a multiple of TALLOC_CACHE_LINE
+	size_t objects; // how many objects fit in one slab
+	size_t colors; // how many different offsets the slack space allows
+	size_t next_color; // the color of the next slab assigned to this class
+	talloc_slab_t *partial; // slabs with at least one free object
+} talloc_slab_class_t;
+
+// This struct follows the arena header in slab arenas. It is followed by the
+// slab descriptors and their bitmaps, and the slabs themselves start on the
+// next page boundary.
+// Allocations too big for any size class get a slab arena of their own,
+// holding one slab with one object, which uses the `dedicated` size class.
+typedef struct __talloc_slab_arena_t {
+	talloc_slab_t *unused; // slabs not assigned to any size class
+	size_t nslabs, nunused; // total and unused number of slabs
+	size_t slabsize; // size of each slab
+	void *slabs; // address of the first slab
+	talloc_slab_class_t dedicated; // size class of a dedicated slab arena
+} talloc_slab_arena_t;
+
+// This struct represents a free block in a buddy arena. It's stored in
+// the block itself.
+typedef struct __talloc_buddy_block_t {
+	struct __talloc_buddy_block_t *next; // next free block of the same order
+	struct __talloc_buddy_block_t *prev; // previous free block of the same order
+} talloc_buddy_block_t;
+
+#define TALLOC_BUDDY_FREE 0x80 // set in the order map for free blocks
+
+// This struct follows the arena header in buddy arenas. A block of order `n`
+// spans 2^n pages, and its buddy is found by flipping bit `n` of its page
+// index. The order map has one byte per page, and holds the order of each
+// block (plus TALLOC_BUDDY_FREE) at the index of its first page. Every other
+// byte has TALLOC_BUDDY_FREE set, so that only the first page of an allocated
+// block can be freed, and only once. The blocks start on the first page
+// boundary after the order map.
+typedef struct __talloc_buddy_arena_t {
+	uint32_t free_orders; // bitmap of orders with a non-empty free list
+	size_t maxorder; // order of the largest blocks
+	size_t npages; // number of pages in the pool
+	size_t used; // number of pages allocated
+	void *pool; // address of the first block
+	talloc_buddy_block_t *free_lists[TALLOC_BUDDY_ORDERS]; // free blocks of each order
+	unsigned char orders[]; // the order map
+} talloc_buddy_arena_t;
+
+// This struct is the header of a run: a chunk an allocation context takes
+// from the arenas with TAlloc_malloc, and carves objects from.
+typedef struct __talloc_ctx_run_t {
+	struct __talloc_ctx_run_t *next; // next run of the same context
+} talloc_ctx_run_t;
+
+// This struct represents an allocation context. Contexts form a tree, and
+// freeing a context frees everything allocated in it and in its descendants,
+// one run at a time. Objects in a context can't be freed on their own.
+typedef struct __talloc_ctx_t {
+	struct __talloc_ctx_t *parent; // parent context, NULL for a root
+	struct __talloc_ctx_t *children; // first child context
+	struct __talloc_ctx_t *next; // next sibling
+	struct __talloc_ctx_t *prev; // previous sibling
+	talloc_ctx_run_t *runs; // runs of the context, the one being carved first
+	void *bump; // where the next object of the first run goes
+	void *end; // end of the first run
+} talloc_ctx_t;
+
+#if TALLOC_ENGINE == TALLOC_ENGINE_TLSF
+#define TALLOC_TLSF_SL_COUNT (1 << TALLOC_TLSF_SL_LOG2)
+// sizes below 1 << TALLOC_TLSF_FL_SHIFT all go to first-level class 0,
+// which is split linearly in TALLOC_ALIGNMENT steps
+#define TALLOC_TLSF_FL_SHIFT (TALLOC_TLSF_SL_LOG2 + 4)
+#define TALLOC_TLSF_FL_COUNT (TALLOC_TLSF_FL_MAX - TALLOC_TLSF_FL_SHIFT + 1)
+
+// This struct holds the TLSF free lists, shared by all arenas. A bit in
+// fl_bitmap tells whether any list of a first-level class is non-empty, and
+// a bit in sl_bitmap tells whether a given second-level list is non-empty,
+// so a suitable free block is found with two bit scans.
+typedef struct __talloc_tlsf_t {
+	uint64_t fl_bitmap;
+	uint32_t sl_bitmap[TALLOC_TLSF_FL_COUNT];
+	talloc_block_t *blocks[TALLOC_TLSF_FL_COUNT][TALLOC_TLSF_SL_COUNT];
+} talloc_tlsf_t;
+#endif
+
+#if TALLOC_ENGINE != TALLOC_ENGINE_LIST
+// the size of reserved space for a newly allocated arena: the arena header,
+// the header of its first block, and a zero-sized sentinel block at the end,
+// which stops coalescing from running past the arena
+#define TALLOC_ARENA_OVERHEAD (TALLOC_ALIGN_UP(sizeof(talloc_arena_t) + sizeof(talloc_header_t)) + sizeof(talloc_header_t))
+#else
 // the size of reserved space for a newly allocated arena
 #define TALLOC_ARENA_OVERHEAD (sizeof(talloc_arena_t) + sizeof(talloc_chunk_t))
+#endif
+
+// This struct holds the live bytes of every tag, as counted by the threads
+// using this shard. A thread always updates the same shard, so threads don't
+// all fight over the same cache lines. Memory can be freed by another thread
+// than the one that allocated it, so a shard's counter can wrap around below
+// zero; only the sum over all shards means anything.
+typedef struct __talloc_tag_shard_t {
+	size_t live[TALLOC_TAGS];
+} __attribute__((aligned(TALLOC_CACHE_LINE))) talloc_tag_shard_t;
+
+// A snapshot of the heap, filled in by TAlloc_stats.
+typedef struct __talloc_stats_t {
+	size_t arenas; // how many arenas there are, the bootstrap arena included
+	size_t mapped; // bytes in arenas
+	size_t peak_mapped; // the most bytes there have ever been in arenas
+	size_t in_use; // bytes handed out from general arenas, headers included
+	talloc_lock_stats_t lock; // contention on the heap lock, with TALLOC_THREADS and TALLOC_LOCK_STATS
+} talloc_stats_t;
+
+#if TALLOC_THREADS
+// The depot of a size class: batches ("magazines") of blocks that thread
+// caches had too many of, for other threads to take. Each magazine is a
+// chain of blocks linked through their first word, and magazines are linked
+// through the second word of their first block. Magazines are pushed with
+// a compare-and-swap, and taken by grabbing the whole stack with an
+// exchange and putting back the rest, so no lock is needed (and there's no
+// ABA problem: nobody pops a single node that might come back meanwhile).
+typedef struct __talloc_depot_t {
+	void *magazines;
+	int count; // roughly how many magazines there are (a take can run before the matching push counts)
+	uint64_t used_time; // when a magazine was last taken, or pushed onto an empty depot, in milliseconds
+} __attribute__((aligned(TALLOC_CACHE_LINE))) talloc_depot_t;
+#endif
 
 // This struct represents the state of our allocator.
 typedef struct __talloc_state_t {
 	talloc_arena_t *arena_head; // the head of the arena linked list
 	talloc_arena_t *arena_tail; // the tail of the arena linked list
-	size_t minallocsize, pagesize; // the page size
-	char initialized; // has the first arena been allocated?
+	size_t minallocsize; // the size of the next general arena, unless a request needs more
+	size_t pagesize; // the page size
+	char initialized; // have pagesize and minallocsize been set up?
+	int options; // TALLOC_OPT_* flags
+	// tunables, which default to the macros of the same name, and can be
+	// set in the TALLOC_CONF environment variable
+	size_t alloc_pages; // TALLOC_ALLOC_PAGES
+	size_t trim_pages; // TALLOC_TRIM_PAGES
+	size_t mmap_threshold; // requests from this size on get an arena of their own
+	int arena_policy; // TALLOC_ARENA_POLICY
+	size_t conf_reserve; // bytes to reserve at initialization
+	char conf_stats; // print stats at exit?
+	size_t mapped, peak_mapped; // bytes in arenas right now, and at most so far
+	talloc_arena_desc_t *arenas; // arena descriptors, mapped separately
+	size_t narenas, arenas_capacity; // number of arenas, and of descriptors that fit in `arenas`
+#if TALLOC_POLICY == TALLOC_POLICY_NEXT_FIT
+	size_t arena_rover; // index of the arena the last search succeeded in
+#endif
+	talloc_slab_class_t slab_classes[TALLOC_SLAB_CLASSES]; // cache-line size classes
+#if TALLOC_ENGINE == TALLOC_ENGINE_TLSF
+	talloc_tlsf_t tlsf; // free lists of the TLSF engine
+#endif
+	const char *pressure_file; // cgroup memory.pressure or memory.events file, or a stand-in
+	int (*pressure_callback)(void); // returns non-zero while memory is under pressure
+	unsigned long long pressure_events; // "high" count last read from memory.events
+	unsigned int pressure_countdown; // calls left until the next poll of the pressure source
+	char under_pressure; // is memory under pressure right now?
+#if TALLOC_THREADS
+	talloc_lock_t lock; // guards everything else, except the tag counters
+	pthread_key_t tcache_key; // flushes the cache of a thread when it exits
+	unsigned int tcache_count; // most blocks a thread caches per size class, 0 for no caching
+	unsigned int tcache_gc_ms; // how often caches drop blocks they don't need, 0 for never
+	talloc_depot_t depot[TALLOC_TCACHE_CLASSES]; // blocks on their way between threads
+	struct __talloc_tcache_t *caches; // the caches of all threads, newest first
+	uint64_t depot_gc_time; // when the depots were last checked for unwanted magazines, in milliseconds
+	void *deferred; // deferred frees handed to the reclaimer thread, chained through their first word
+	size_t deferred_count; // how many frees were handed over and aren't done yet
+	unsigned int deferred_batches; // how many threads hold deferred frees they didn't hand over yet
+	char reclaimer_started, reclaimer_sleeping; // is the reclaimer running, and is it waiting for work?
+	pthread_mutex_t reclaimer_mutex; // the reclaimer sleeps on reclaimer_cond with this
+	pthread_cond_t reclaimer_cond;
+#endif
+	size_t tag_quotas[TALLOC_TAGS]; // how many bytes each tag may use, 0 for no limit
+	unsigned int tag_threads; // how many threads have picked a shard of the tag counters
+	talloc_tag_shard_t tag_shards[TALLOC_TAG_SHARDS]; // live bytes of each tag
 } talloc_state_t;
 
 // our state is stored here
+#if TALLOC_THREADS
+talloc_state_t state = {
+	.lock = TALLOC_LOCK_INITIALIZER,
+	.reclaimer_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.reclaimer_cond = PTHREAD_COND_INITIALIZER
+};
+#else
 talloc_state_t state;
+#endif
 
-// Initializes an allocated arena.
-void TAlloc_init_arena(talloc_arena_t *arena, size_t allocated) {
-	arena->allocated = allocated;
-	arena->max_free_space = allocated - TALLOC_ARENA_OVERHEAD;
-	arena->next = NULL;
-	arena->prev = NULL;
-	// the free chunks linked list starts right after the arena header/struct
-	talloc_chunk_t *free_list = (talloc_chunk_t *) (arena + 1);
-	free_list->size = arena->max_free_space;
-	free_list->next = NULL;
-	arena->free_list = free_list;
+#if TALLOC_THREADS
+// The current time, in nanoseconds.
+uint64_t TAlloc_now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-// Initialize the allocator's state, and allocate the first arena.
-void TAlloc_initialize() {
-	state.pagesize = getpagesize();
-	state.minallocsize = state.pagesize * TALLOC_ALLOC_PAGES;
-	state.arena_head = mmap(NULL, state.minallocsize, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
-	if (state.arena_head == MAP_FAILED) {
-		state.arena_head = NULL;
+// Tell the CPU we're spinning, so it can give the other hyperthread a go.
+void TAlloc_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+// Try to take a lock without waiting.
+int TAlloc_try_lock(talloc_lock_t *lock) {
+#ifdef __linux__
+	int free = 0;
+	return __atomic_compare_exchange_n(&lock->word, &free, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+#else
+	return !pthread_mutex_trylock(&lock->mutex);
+#endif
+}
+
+// Take a lock. If it's taken, spin up to spin_limit times, then sleep until
+// it's free. A thread that got the lock by spinning moves the limit towards
+// twice what it took, and one that had to sleep halves it, since the holder
+// is probably not running and spinning is a waste.
+void TAlloc_lock(talloc_lock_t *lock) {
+	if (TAlloc_try_lock(lock)) {
+#if TALLOC_LOCK_STATS
+		++lock->stats.acquisitions;
+#endif
 		return;
 	}
-	state.arena_tail = state.arena_head;
-	TAlloc_init_arena(state.arena_head, state.minallocsize);
-	state.initialized = 1;
+#if TALLOC_LOCK_STATS
+	uint64_t start = TAlloc_now_ns();
+#endif
+	int limit = __atomic_load_n(&lock->spin_limit, __ATOMIC_RELAXED);
+	int spins = 0;
+	int taken = 0;
+	while (spins < limit) {
+		++spins;
+		TAlloc_cpu_relax();
+#ifdef __linux__
+		if (__atomic_load_n(&lock->word, __ATOMIC_RELAXED) == 0 && TAlloc_try_lock(lock)) {
+#else
+		if (TAlloc_try_lock(lock)) {
+#endif
+			taken = 1;
+			break;
+		}
+	}
+	if (taken) {
+		limit += (2 * spins - limit) / 8;
+	} else {
+#ifdef __linux__
+		// mark the lock as having sleepers, and sleep until it's free
+		while (__atomic_exchange_n(&lock->word, 2, __ATOMIC_ACQUIRE) != 0) {
+			syscall(SYS_futex, &lock->word, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+		}
+#else
+		pthread_mutex_lock(&lock->mutex);
+#endif
+		limit /= 2;
+	}
+	if (limit < TALLOC_SPIN_MIN) limit = TALLOC_SPIN_MIN;
+	if (limit > TALLOC_SPIN_MAX) limit = TALLOC_SPIN_MAX;
+	__atomic_store_n(&lock->spin_limit, limit, __ATOMIC_RELAXED);
+#if TALLOC_LOCK_STATS
+	++lock->stats.acquisitions;
+	++lock->stats.contended;
+	lock->stats.spins += spins;
+	lock->stats.wait_ns += TAlloc_now_ns() - start;
+#endif
 }
 
-// Allocate memory for a new arena. The resulting arena will
-// be at least state.minallocsize, no matter how small the 
-// space needed is. If it's greater than state.minallocsize,
-// then the allocated size will be a multiple of state.pagesize.
-talloc_arena_t * TAlloc_create_arena(size_t space_needed) {
-	// account for possible overflow
-	if (space_needed + TALLOC_ARENA_OVERHEAD < space_needed) return NULL;
-	space_needed += TALLOC_ARENA_OVERHEAD;
+// Release a lock, and wake up a sleeping thread, if there may be one.
+void TAlloc_unlock(talloc_lock_t *lock) {
+#ifdef __linux__
+	if (__atomic_exchange_n(&lock->word, 0, __ATOMIC_RELEASE) == 2) {
+		syscall(SYS_futex, &lock->word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+#else
+	pthread_mutex_unlock(&lock->mutex);
+#endif
+}
+#endif
 
-	size_t to_allocate;
+// The bootstrap arena and the first descriptor table are static, so the
+// first allocations, and all of them in small programs, don't map anything.
+char talloc_bootstrap[TALLOC_BOOTSTRAP_SIZE] __attribute__((aligned(4096)));
+talloc_arena_desc_t talloc_bootstrap_arenas[TALLOC_BOOTSTRAP_ARENAS];
 
-	if (space_needed <= state.minallocsize) {
-		// ensure we allocate at least state.minallocsize bytes
-		to_allocate = state.minallocsize;
-	} else {
-		// check if not evenly divided by page size
-		// we always map multiples of page size
-		unsigned int add_one = space_needed % state.pagesize > 0;
-		to_allocate = state.pagesize * ((space_needed / state.pagesize) + add_one);
+// the tag allocations of this thread are charged to, and the shard of the
+// tag counters it updates (plus one, so zero means not picked yet)
+__thread int talloc_current_tag;
+__thread unsigned int talloc_tag_shard;
+
+#if TALLOC_THREADS
+// A thread cache: a stack of free blocks per size class, linked through
+// their first word. `low` is the fewest blocks a class had since the last
+// garbage collection, which is how many it could have done without.
+//
+// Caches are also linked into a list of all of them, so that other threads
+// can collect the cache of a thread that went quiet. The owner takes blocks
+// without the lock, so a collector also takes `busy`, and the owner goes
+// to the heap instead while a collector has it.
+typedef struct __talloc_tcache_t {
+	void *bins[TALLOC_TCACHE_CLASSES];
+	unsigned int count[TALLOC_TCACHE_CLASSES];
+	unsigned int low[TALLOC_TCACHE_CLASSES];
+	unsigned int ticks; // cache operations since the clock was last looked at
+	uint64_t gc_time; // when the cache was last collected, in milliseconds
+	struct __talloc_tcache_t *next_cache; // the next cache in state.caches
+	char busy; // is the owner taking a block, or another thread collecting the cache?
+	char registered; // has the destructor been set up, and the cache put in state.caches?
+	char exited; // has the thread gone through its destructor already?
+	char uncached; // do frees skip the cache? (they do on the reclaimer thread)
+	void *deferred, *deferred_last; // deferred frees, chained through their first word
+	unsigned int ndeferred; // how many of them
+	uint64_t deferred_time; // when the first of them was deferred, in milliseconds
+} talloc_tcache_t;
+
+__thread talloc_tcache_t talloc_tcache;
+#endif
+
+// Check whether the allocator has been initialized. TAlloc_initialize sets
+// the flag last, so a thread that sees it also sees the rest of the state.
+int TAlloc_is_initialized() {
+	return __atomic_load_n(&state.initialized, __ATOMIC_ACQUIRE);
+}
+
+// The descriptor of an arena.
+talloc_arena_desc_t * TAlloc_desc(talloc_arena_t *arena) {
+	return &state.arenas[arena->index];
+}
+
+// Check whether an arena is pinned: the static bootstrap arena, and arenas
+// made by TAlloc_reserve, are never unmapped or trimmed. Neither is any
+// arena while TALLOC_OPT_POPULATE or TALLOC_OPT_MLOCK is set, so that
+// allocations don't map and fault in arenas that were just given back.
+int TAlloc_is_pinned(talloc_arena_t *arena) {
+	return TAlloc_desc(arena)->pinned || state.options & (TALLOC_OPT_POPULATE|TALLOC_OPT_MLOCK);
+}
+
+// Fault in the pages of freshly mapped memory, and lock them if
+// TALLOC_OPT_MLOCK is set. Each page is read and written back as it was,
+// which is only safe while no one else can see the memory.
+void TAlloc_warm(void *memory, size_t size, int options) {
+	if (options & TALLOC_OPT_POPULATE) {
+		for (size_t offset = 0; offset < size; offset += state.pagesize) {
+			volatile char *byte = (volatile char *) memory + offset;
+			*byte = *byte;
+		}
 	}
+	// if locking fails (say, because of RLIMIT_MEMLOCK), the memory is
+	// still perfectly usable, so we carry on
+	if (options & TALLOC_OPT_MLOCK) mlock(memory, size);
+}
 
-	
-	void *new_arena = mmap(NULL, to_allocate, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
-	if (new_arena == MAP_FAILED) {
+// Fault in the pages of memory that's already in use, and lock them if
+// TALLOC_OPT_MLOCK is set. Other threads may be writing to it without the
+// lock, so nothing is written back here: the kernel populates the pages
+// with MADV_POPULATE_WRITE where it can, and otherwise each page is only
+// read (mlock then faults them in for writing all the same).
+void TAlloc_warm_in_use(void *memory, size_t size, int options) {
+	if (options & TALLOC_OPT_POPULATE) {
+		int populated = 0;
+#ifdef MADV_POPULATE_WRITE
+		uintptr_t start = (uintptr_t) memory & ~(uintptr_t) (state.pagesize - 1);
+		populated = !madvise((void *) start, (uintptr_t) memory + size - start, MADV_POPULATE_WRITE);
+#endif
+		for (size_t offset = 0; !populated && offset < size; offset += state.pagesize) {
+			(void) *((volatile char *) memory + offset);
+		}
+	}
+	if (options & TALLOC_OPT_MLOCK) mlock(memory, size);
+}
+
+// Map memory for the allocator's own use, honoring TALLOC_OPT_* options.
+void * TAlloc_mmap(size_t size) {
+	int flags = MAP_ANON|MAP_PRIVATE;
+	int options = state.options;
+#ifdef MAP_POPULATE
+	if (options & TALLOC_OPT_POPULATE) {
+		flags |= MAP_POPULATE;
+		options &= ~TALLOC_OPT_POPULATE;
+	}
+#endif
+	void *memory = mmap(NULL, size, PROT_READ|PROT_WRITE, flags, -1, 0);
+	if (memory == MAP_FAILED) {
 		return NULL;
 	}
+	TAlloc_warm(memory, size, options);
+	return memory;
+}
 
-	talloc_arena_t *arena = (talloc_arena_t *) new_arena;
-	// initialize the newly created arena
-	TAlloc_init_arena(arena, to_allocate);
+// Make room for one more descriptor, moving the descriptor table to a
+// mapping twice as big if it's full. Returns 0 if that fails.
+int TAlloc_grow_arenas() {
+	if (state.narenas < state.arenas_capacity) return 1;
+	size_t capacity = 2 * state.arenas_capacity;
+	talloc_arena_desc_t *arenas = TAlloc_mmap(capacity * sizeof(talloc_arena_desc_t));
+	if (!arenas) {
+		return 0;
+	}
+	for (size_t i = 0; i < state.narenas; ++i) arenas[i] = state.arenas[i];
+	if (state.arenas != talloc_bootstrap_arenas) munmap(state.arenas, state.arenas_capacity * sizeof(talloc_arena_desc_t));
+	state.arenas = arenas;
+	state.arenas_capacity = capacity;
+	return 1;
+}
+
+// Give the arena at the given memory a descriptor, and set up its header.
+// There must be room for the descriptor. The arena isn't linked into the
+// arena list yet.
+talloc_arena_t * TAlloc_add_arena(void *memory, size_t size, char kind) {
+	talloc_arena_t *arena = (talloc_arena_t *) memory;
+	arena->index = state.narenas++;
+	arena->free_list = NULL;
+	arena->next = NULL;
+	arena->prev = NULL;
+	arena->kind = kind;
 
+	talloc_arena_desc_t *desc = TAlloc_desc(arena);
+	desc->arena = arena;
+	desc->allocated = size;
+	desc->max_free_space = 0;
+	desc->used = 0;
+	desc->pinned = 0;
+	state.mapped += size;
+	if (state.mapped > state.peak_mapped) state.peak_mapped = state.mapped;
+#if TALLOC_ENGINE == TALLOC_ENGINE_BINS
+	desc->binmap = 0;
+#endif
 	return arena;
 }
 
-// Called when we can't find enough free space in existing arenas.
-// This will call TAlloc_create_arena to create a new arena and return it
-talloc_arena_t * TAlloc_alloc_more_space(size_t space_needed) {
-	talloc_arena_t *arena = TAlloc_create_arena(space_needed);
-	if (!arena) {
+// Map a new arena of the given size and kind, and give it a descriptor.
+// The arena isn't linked into the arena list yet.
+talloc_arena_t * TAlloc_map_arena(size_t size, char kind) {
+	if (!TAlloc_grow_arenas()) return NULL;
+	void *memory = TAlloc_mmap(size);
+	if (!memory) {
 		return NULL;
 	}
+#ifdef MADV_HUGEPAGE
+	if (kind == TALLOC_ARENA_GENERAL && state.options & TALLOC_OPT_THP) madvise(memory, size, MADV_HUGEPAGE);
+	if (kind == TALLOC_ARENA_GENERAL && state.options & TALLOC_OPT_NO_THP) madvise(memory, size, MADV_NOHUGEPAGE);
+#endif
+	return TAlloc_add_arena(memory, size, kind);
+}
 
-	// insert the newly created arena into the linked list
-	state.arena_tail->next = arena;
-	arena->prev = state.arena_tail;
-	state.arena_tail = arena;
+#if TALLOC_ENGINE == TALLOC_ENGINE_TLSF
+// Compute the first- and second-level indexes of the free list
+// holding blocks of the given size.
+void TAlloc_tlsf_mapping(size_t size, int *fl, int *sl) {
+	if (size < (1 << TALLOC_TLSF_FL_SHIFT)) {
+		*fl = 0;
+		*sl = size / TALLOC_ALIGNMENT;
+	} else {
+		int log2 = 63 - __builtin_clzll(size);
+		*sl = (size >> (log2 - TALLOC_TLSF_SL_LOG2)) ^ TALLOC_TLSF_SL_COUNT;
+		*fl = log2 - TALLOC_TLSF_FL_SHIFT + 1;
+	}
+}
+
+// Find a non-empty free list whose blocks are all at least `size` bytes.
+// The size is rounded up to the next list boundary first, so that any block
+// of the list found will do, which keeps both the search and the fit good.
+talloc_block_t * TAlloc_tlsf_find(size_t size) {
+	int fl, sl;
+	if (size >= (1 << TALLOC_TLSF_FL_SHIFT)) {
+		size += ((size_t) 1 << (63 - __builtin_clzll(size) - TALLOC_TLSF_SL_LOG2)) - 1;
+	}
+	TAlloc_tlsf_mapping(size, &fl, &sl);
+	if (fl >= TALLOC_TLSF_FL_COUNT) return NULL;
+
+	uint32_t sl_map = state.tlsf.sl_bitmap[fl] & (~0U << sl);
+	if (!sl_map) {
+		uint64_t fl_map = state.tlsf.fl_bitmap & (~0ULL << (fl + 1));
+		if (!fl_map) return NULL;
+		fl = __builtin_ctzll(fl_map);
+		sl_map = state.tlsf.sl_bitmap[fl];
+	}
+	sl = __builtin_ctz(sl_map);
+	return state.tlsf.blocks[fl][sl];
+}
+
+// Insert a free block at the head of its free list. The free lists are
+// shared by all arenas, so the arena isn't needed.
+void TAlloc_insert_block(talloc_arena_t *arena, talloc_block_t *block) {
+	(void) arena;
+	int fl, sl;
+	TAlloc_tlsf_mapping(block->size & ~TALLOC_BLOCK_FLAGS, &fl, &sl);
+	block->prev_free = NULL;
+	block->next_free = state.tlsf.blocks[fl][sl];
+	if (block->next_free) block->next_free->prev_free = block;
+	state.tlsf.blocks[fl][sl] = block;
+	state.tlsf.fl_bitmap |= 1ULL << fl;
+	state.tlsf.sl_bitmap[fl] |= 1U << sl;
+}
+
+// Remove a free block from its free list.
+void TAlloc_remove_block(talloc_arena_t *arena, talloc_block_t *block) {
+	(void) arena;
+	int fl, sl;
+	TAlloc_tlsf_mapping(block->size & ~TALLOC_BLOCK_FLAGS, &fl, &sl);
+	if (block->next_free) block->next_free->prev_free = block->prev_free;
+	if (block->prev_free) {
+		block->prev_free->next_free = block->next_free;
+	} else {
+		state.tlsf.blocks[fl][sl] = block->next_free;
+		if (!block->next_free) {
+			state.tlsf.sl_bitmap[fl] &= ~(1U << sl);
+			if (!state.tlsf.sl_bitmap[fl]) state.tlsf.fl_bitmap &= ~(1ULL << fl);
+		}
+	}
+}
+#elif TALLOC_ENGINE == TALLOC_ENGINE_BINS
+// Compute the bin holding free blocks of the given size.
+int TAlloc_bin_index(size_t size) {
+	if (size <= TALLOC_SMALL_BINS * TALLOC_ALIGNMENT) return size / TALLOC_ALIGNMENT - 1;
+	int log2 = 63 - __builtin_clzll(size);
+	int index = TALLOC_SMALL_BINS + 2 * (log2 - (63 - __builtin_clzll(TALLOC_SMALL_BINS * TALLOC_ALIGNMENT)))
+		+ ((size >> (log2 - 1)) & 1);
+	return index < TALLOC_BINS ? index : TALLOC_BINS - 1;
+}
+
+// Insert a free block at the head of its bin.
+void TAlloc_insert_block(talloc_arena_t *arena, talloc_block_t *block) {
+	int index = TAlloc_bin_index(block->size & ~TALLOC_BLOCK_FLAGS);
+	block->prev_free = NULL;
+	block->next_free = arena->bins[index];
+	if (block->next_free) block->next_free->prev_free = block;
+	arena->bins[index] = block;
+	TAlloc_desc(arena)->binmap |= 1ULL << index;
+}
+
+// Remove a free block from its bin.
+void TAlloc_remove_block(talloc_arena_t *arena, talloc_block_t *block) {
+	if (block->next_free) block->next_free->prev_free = block->prev_free;
+	if (block->prev_free) {
+		block->prev_free->next_free = block->next_free;
+	} else {
+		int index = TAlloc_bin_index(block->size & ~TALLOC_BLOCK_FLAGS);
+		arena->bins[index] = block->next_free;
+		if (!block->next_free) TAlloc_desc(arena)->binmap &= ~(1ULL << index);
+	}
+}
+
+// Find a free block of at least `size` bytes in the arena. Small bins hold a
+// single size, so their first block will do. Blocks in a large bin differ in
+// size, so the first few are looked at. Failing that, any block of the
+// smallest non-empty bin above will do, and the bitmap finds it in one scan.
+talloc_block_t * TAlloc_bins_find(talloc_arena_t *arena, size_t size) {
+	int index = TAlloc_bin_index(size);
+	talloc_block_t *block = arena->bins[index];
+	for (int i = 0; block && i < TALLOC_BINS_SCAN; ++i, block = block->next_free) {
+		if ((block->size & ~TALLOC_BLOCK_FLAGS) >= size) return block;
+	}
+	if (index + 1 == TALLOC_BINS) return NULL;
+	uint64_t binmap = TAlloc_desc(arena)->binmap & (~0ULL << (index + 1));
+	return binmap ? arena->bins[__builtin_ctzll(binmap)] : NULL;
+}
+#endif
+
+// Give the whole pages between two addresses back to the OS, without
+// unmapping them. They read as zeros (or their old contents, with
+// MADV_FREE) the next time they're used.
+void TAlloc_purge_range(void *start, void *end) {
+	uintptr_t first = ((uintptr_t) start + state.pagesize - 1) & ~(uintptr_t) (state.pagesize - 1);
+	uintptr_t last = (uintptr_t) end & ~(uintptr_t) (state.pagesize - 1);
+	if (first < last) madvise((void *) first, last - first, TALLOC_PURGE_ADVICE);
+}
+
+// The magic of a header: TALLOC_MAGIC, or its top bits with
+// TALLOC_COMPACT_HEADER, mixed with the tag of the allocation.
+uintptr_t TAlloc_header_magic(talloc_header_t *header) {
+#ifdef TALLOC_CHECK_SHIFT
+	return header->size >> TALLOC_CHECK_SHIFT;
+#else
+	return header->magic;
+#endif
+}
+
+void TAlloc_set_header_magic(talloc_header_t *header, uintptr_t magic) {
+#ifdef TALLOC_CHECK_SHIFT
+	header->size = (header->size & ~TALLOC_CHECK_MASK) | (size_t) magic << TALLOC_CHECK_SHIFT;
+#else
+	header->magic = magic;
+#endif
+}
+
+#if TALLOC_ENGINE != TALLOC_ENGINE_LIST
+// The block right after the given one in memory.
+talloc_block_t * TAlloc_next_block(talloc_block_t *block) {
+	return (talloc_block_t *) ((void *) block + sizeof(talloc_header_t) + (block->size & ~TALLOC_BLOCK_FLAGS));
+}
+
+// Flag a block as free, let the next block know, and write the footer
+// the next block will use to find this one when coalescing.
+void TAlloc_mark_block_free(talloc_block_t *block) {
+	talloc_block_t *next = TAlloc_next_block(block);
+	block->size |= TALLOC_BLOCK_FREE;
+	next->size |= TALLOC_BLOCK_PREV_FREE;
+	*((talloc_block_t **) next - 1) = block;
+}
+
+// Flag a block as allocated, and let the next block know.
+void TAlloc_mark_block_used(talloc_block_t *block) {
+	TAlloc_next_block(block)->size &= ~TALLOC_BLOCK_PREV_FREE;
+	block->size &= ~TALLOC_BLOCK_FREE;
+	TAlloc_set_header_magic((talloc_header_t *) block, TALLOC_HEADER_MAGIC);
+}
+
+// The first block of an arena, placed so that its payload is aligned.
+talloc_block_t * TAlloc_first_block(talloc_arena_t *arena) {
+	return (talloc_block_t *) ((void *) arena + TALLOC_PAYLOAD_UP(sizeof(talloc_arena_t)));
+}
+
+// Give the pages at the end of an arena back to the OS if its last block,
+// which must be free and not yet inserted, spans more than TALLOC_TRIM_PAGES
+// of them (or any, under memory pressure). The block shrinks to what is left in its first pages, and the
+// sentinel moves to the new end of the arena.
+void TAlloc_trim_arena(talloc_arena_t *arena, talloc_block_t *block) {
+	// pinned arenas keep all their pages
+	if (TAlloc_is_pinned(arena)) return;
+	talloc_arena_desc_t *desc = TAlloc_desc(arena);
+	size_t keep = (void *) block + 2 * sizeof(talloc_header_t) + TALLOC_BLOCK_MIN_SIZE - (void *) arena;
+	keep = state.pagesize * ((keep + state.pagesize - 1) / state.pagesize);
+	if (desc->allocated - keep < (state.under_pressure ? 1 : state.trim_pages) * state.pagesize) return;
+	if (munmap((void *) arena + keep, desc->allocated - keep)) return;
+	state.mapped -= desc->allocated - keep;
+	desc->allocated = keep;
+
+	size_t size = (void *) arena + keep - (void *) block - 2 * sizeof(talloc_header_t);
+	block->size = TALLOC_PAYLOAD_DOWN(size) | (block->size & TALLOC_BLOCK_FLAGS);
+	talloc_header_t *sentinel = (talloc_header_t *) TAlloc_next_block(block);
+	sentinel->size = 0;
+	TAlloc_set_header_magic(sentinel, TALLOC_HEADER_MAGIC);
+	TAlloc_mark_block_free(block);
+}
+
+// Purge the pages of a free block, except for its links and its footer.
+void TAlloc_purge_block(talloc_block_t *block) {
+	TAlloc_purge_range(block + 1, (void *) TAlloc_next_block(block) - sizeof(talloc_block_t *));
+}
+#endif
+
+// The size of a free chunk, in bytes.
+size_t TAlloc_chunk_size(talloc_chunk_t *chunk) {
+#if TALLOC_CHUNK_OFFSETS
+	return (size_t) chunk->size * TALLOC_GRANULE;
+#else
+	return chunk->size;
+#endif
+}
+
+void TAlloc_set_chunk_size(talloc_chunk_t *chunk, size_t size) {
+#if TALLOC_CHUNK_OFFSETS
+	chunk->size = size / TALLOC_GRANULE;
+#else
+	chunk->size = size;
+#endif
+}
+
+// The free chunk after the given one in its arena's free list, or NULL.
+talloc_chunk_t * TAlloc_chunk_next(talloc_arena_t *arena, talloc_chunk_t *chunk) {
+#if TALLOC_CHUNK_OFFSETS
+	return chunk->next ? (talloc_chunk_t *) ((void *) arena + (size_t) chunk->next * TALLOC_GRANULE) : NULL;
+#else
+	(void) arena;
+	return chunk->next;
+#endif
+}
+
+void TAlloc_set_chunk_next(talloc_arena_t *arena, talloc_chunk_t *chunk, talloc_chunk_t *next) {
+#if TALLOC_CHUNK_OFFSETS
+	// the arena header is at offset 0, so no chunk is ever there
+	chunk->next = next ? ((void *) next - (void *) arena) / TALLOC_GRANULE : 0;
+#else
+	(void) arena;
+	chunk->next = next;
+#endif
+}
+
+// The size of the free chunk needed to hold an allocation of the given
+// size. Chunks and headers take the same space, unless chunk links are
+// offsets, and then all chunks are kept a whole number of granules. Every
+// chunk holds at least a pointer, which TAlloc_free_deferred chains blocks
+// through.
+size_t TAlloc_chunk_size_for(size_t size) {
+	if (size > SIZE_MAX - TALLOC_GRANULE - sizeof(talloc_header_t)) return SIZE_MAX;
+	if (size < sizeof(void *)) size = sizeof(void *);
+#if TALLOC_CHUNK_OFFSETS
+	size = (size + TALLOC_GRANULE - 1) & ~(size_t) (TALLOC_GRANULE - 1);
+#endif
+	return size + sizeof(talloc_header_t) - sizeof(talloc_chunk_t);
+}
+
+// Initializes a newly mapped general arena.
+void TAlloc_init_arena(talloc_arena_t *arena) {
+	talloc_arena_desc_t *desc = TAlloc_desc(arena);
+	desc->max_free_space = desc->allocated - TALLOC_ARENA_OVERHEAD;
+#if TALLOC_ENGINE != TALLOC_ENGINE_LIST
+	// the whole arena is one free block, followed by the sentinel
+#if TALLOC_ENGINE == TALLOC_ENGINE_BINS
+	for (int i = 0; i < TALLOC_BINS; ++i) arena->bins[i] = NULL;
+#endif
+	talloc_block_t *block = TAlloc_first_block(arena);
+	block->size = TALLOC_PAYLOAD_DOWN(desc->max_free_space);
+	talloc_header_t *sentinel = (talloc_header_t *) TAlloc_next_block(block);
+	sentinel->size = 0;
+	TAlloc_set_header_magic(sentinel, TALLOC_HEADER_MAGIC);
+	TAlloc_mark_block_free(block);
+	TAlloc_insert_block(arena, block);
+#else
+	// the free chunks linked list starts right after the arena header/struct
+	talloc_chunk_t *free_list = (talloc_chunk_t *) (arena + 1);
+	TAlloc_set_chunk_size(free_list, desc->max_free_space);
+	TAlloc_set_chunk_next(arena, free_list, NULL);
+	arena->free_list = free_list;
+#if TALLOC_POLICY == TALLOC_POLICY_NEXT_FIT
+	arena->rover = NULL;
+#endif
+#endif
+}
+
+// Parse a number, with an optional k, m or g suffix, from a TALLOC_CONF
+// value, and move past it.
+size_t TAlloc_parse_size(const char **p) {
+	size_t value = 0;
+	for (; **p >= '0' && **p <= '9'; ++*p) value = value * 10 + (**p - '0');
+	if (**p == 'k' || **p == 'K') value <<= 10, ++*p;
+	else if (**p == 'm' || **p == 'M') value <<= 20, ++*p;
+	else if (**p == 'g' || **p == 'G') value <<= 30, ++*p;
+	return value;
+}
+
+// Check whether the string at `p` starts with `word`, and move past it if so.
+int TAlloc_parse_word(const char **p, const char *word) {
+	const char *q = *p;
+	while (*word && *q == *word) ++q, ++word;
+	if (*word) return 0;
+	*p = q;
+	return 1;
+}
+
+// Apply settings from a TALLOC_CONF string, a comma separated list of
+// key:value pairs, like "arena_pages:4096,arena_policy:fullest,stats:true".
+// The keys are:
+//  - arena_pages, first_arena_pages, trim_pages: page counts
+//  - tcache, tcache_gc_ms: blocks per size class, and milliseconds (with TALLOC_THREADS)
+//  - mmap_threshold, reserve: sizes in bytes (k, m and g suffixes work)
+//  - arena_policy: first or fullest
+//  - populate, mlock, thp, stats: true or false
+// Anything else is skipped.
+void TAlloc_parse_conf(const char *conf) {
+	const char *p = conf;
+	while (p && *p) {
+		if (TAlloc_parse_word(&p, "arena_pages:")) {
+			size_t pages = TAlloc_parse_size(&p);
+			if (pages) state.alloc_pages = pages;
+		} else if (TAlloc_parse_word(&p, "first_arena_pages:")) {
+			size_t pages = TAlloc_parse_size(&p);
+			if (pages) state.minallocsize = state.pagesize * pages;
+		} else if (TAlloc_parse_word(&p, "trim_pages:")) {
+			state.trim_pages = TAlloc_parse_size(&p);
+		} else if (TAlloc_parse_word(&p, "mmap_threshold:")) {
+			size_t threshold = TAlloc_parse_size(&p);
+			state.mmap_threshold = threshold ? threshold : SIZE_MAX;
+		} else if (TAlloc_parse_word(&p, "reserve:")) {
+			state.conf_reserve = TAlloc_parse_size(&p);
+#if TALLOC_THREADS
+		} else if (TAlloc_parse_word(&p, "tcache:")) {
+			state.tcache_count = TAlloc_parse_size(&p);
+		} else if (TAlloc_parse_word(&p, "tcache_gc_ms:")) {
+			state.tcache_gc_ms = TAlloc_parse_size(&p);
+#endif
+		} else if (TAlloc_parse_word(&p, "arena_policy:")) {
+			if (TAlloc_parse_word(&p, "first")) state.arena_policy = TALLOC_ARENA_FIRST;
+			else if (TAlloc_parse_word(&p, "fullest")) state.arena_policy = TALLOC_ARENA_FULLEST;
+		} else {
+			int flag = 0;
+			if (TAlloc_parse_word(&p, "populate:")) flag = TALLOC_OPT_POPULATE;
+			else if (TAlloc_parse_word(&p, "mlock:")) flag = TALLOC_OPT_MLOCK;
+			else if (TAlloc_parse_word(&p, "thp:")) flag = TALLOC_OPT_THP;
+			else if (TAlloc_parse_word(&p, "stats:")) flag = -1;
+			int on = TAlloc_parse_word(&p, "true");
+			if (!on) TAlloc_parse_word(&p, "false");
+			if (flag == -1) state.conf_stats = on;
+			else if (flag == TALLOC_OPT_THP) state.options = (state.options & ~(TALLOC_OPT_THP|TALLOC_OPT_NO_THP)) | (on ? TALLOC_OPT_THP : TALLOC_OPT_NO_THP);
+			else if (on) state.options |= flag;
+			else state.options &= ~flag;
+		}
+		// skip to the next pair
+		while (*p && *p != ',') ++p;
+		if (*p) ++p;
+	}
+	if (state.minallocsize > state.pagesize * state.alloc_pages) state.minallocsize = state.pagesize * state.alloc_pages;
+}
+
+// defined further down, and needed by TAlloc_initialize
+int TAlloc_reserve(size_t bytes);
+void TAlloc_print_stats(void);
+#if TALLOC_THREADS
+void TAlloc_tcache_destroy(void *cache);
+#endif
+
+// Initialize the allocator's state, and set up the static bootstrap arena.
+// Nothing is mapped until the bootstrap arena runs out of space, and then
+// arenas start small and double in size up to TALLOC_ALLOC_PAGES pages, so
+// small programs stay small. Mapped arenas are unmapped again when
+// everything in them is freed.
+void TAlloc_initialize() {
+	TAlloc_lock(&state.lock);
+	if (state.initialized) {
+		// another thread got here first
+		TAlloc_unlock(&state.lock);
+		return;
+	}
+	state.pagesize = getpagesize();
+	state.minallocsize = state.pagesize * TALLOC_FIRST_ARENA_PAGES;
+	state.alloc_pages = TALLOC_ALLOC_PAGES;
+	state.trim_pages = TALLOC_TRIM_PAGES;
+	state.mmap_threshold = SIZE_MAX;
+	state.arena_policy = TALLOC_ARENA_POLICY;
+#if TALLOC_THREADS
+	state.tcache_count = TALLOC_TCACHE_COUNT;
+	state.tcache_gc_ms = TALLOC_TCACHE_GC_MS;
+	pthread_key_create(&state.tcache_key, TAlloc_tcache_destroy);
+#endif
+	TAlloc_parse_conf(getenv("TALLOC_CONF"));
+	state.arenas = talloc_bootstrap_arenas;
+	state.arenas_capacity = TALLOC_BOOTSTRAP_ARENAS;
+
+	talloc_arena_t *arena = TAlloc_add_arena(talloc_bootstrap, TALLOC_BOOTSTRAP_SIZE, TALLOC_ARENA_GENERAL);
+	TAlloc_desc(arena)->pinned = 1;
+	TAlloc_init_arena(arena);
+	state.arena_head = arena;
+	state.arena_tail = arena;
+	__atomic_store_n(&state.initialized, 1, __ATOMIC_RELEASE);
+	TAlloc_unlock(&state.lock);
+
+	if (state.conf_reserve) TAlloc_reserve(state.conf_reserve);
+	if (state.conf_stats) atexit(TAlloc_print_stats);
+}
+
+// Allocate memory for a new arena. The resulting arena will
+// be at least state.minallocsize, no matter how small the 
+// space needed is, and state.minallocsize grows with each arena. If it's greater than state.minallocsize,
+// then the allocated size will be a multiple of state.pagesize.
+talloc_arena_t * TAlloc_create_arena(size_t space_needed) {
+	// account for possible overflow
+	if (space_needed + TALLOC_ARENA_OVERHEAD < space_needed) return NULL;
+	space_needed += TALLOC_ARENA_OVERHEAD;
+
+	size_t to_allocate;
+
+	if (space_needed <= state.minallocsize && space_needed - TALLOC_ARENA_OVERHEAD < state.mmap_threshold) {
+		// ensure we allocate at least state.minallocsize bytes
+		to_allocate = state.minallocsize;
+	} else {
+		// check if not evenly divided by page size
+		// we always map multiples of page size
+		unsigned int add_one = space_needed % state.pagesize > 0;
+		to_allocate = state.pagesize * ((space_needed / state.pagesize) + add_one);
+	}
+#if TALLOC_ENGINE == TALLOC_ENGINE_LIST && TALLOC_CHUNK_OFFSETS
+	// chunk sizes and offsets have to fit in 32 bits
+	if ((uint64_t) to_allocate >= TALLOC_CHUNK_MAX_ARENA) return NULL;
+#endif
+
+	
+	talloc_arena_t *arena = TAlloc_map_arena(to_allocate, TALLOC_ARENA_GENERAL);
+	if (!arena) {
+		return NULL;
+	}
+
+	// initialize the newly created arena
+	TAlloc_init_arena(arena);
+
+	// the heap is growing; the next arena will be bigger
+	if (to_allocate == state.minallocsize && state.minallocsize < state.pagesize * state.alloc_pages) {
+		state.minallocsize *= 2;
+		if (state.minallocsize > state.pagesize * state.alloc_pages) state.minallocsize = state.pagesize * state.alloc_pages;
+	}
+	return arena;
+}
+
+// Insert an arena at the end of the arena linked list.
+void TAlloc_link_arena(talloc_arena_t *arena) {
+	if (state.arena_tail) state.arena_tail->next = arena;
+	else state.arena_head = arena;
+	arena->prev = state.arena_tail;
+	state.arena_tail = arena;
+}
+
+// Called when we can't find enough free space in existing arenas.
+// This will call TAlloc_create_arena to create a new arena and return it
+talloc_arena_t * TAlloc_alloc_more_space(size_t space_needed) {
+	talloc_arena_t *arena = TAlloc_create_arena(space_needed);
+	if (!arena) {
+		return NULL;
+	}
+
+	TAlloc_link_arena(arena);
+	return arena;
+}
+
+// Frees an arena. This is called when an arena is no longer needed.
+// We simply remove it from the linked list, and unmap it.
+// The last descriptor takes the place of the arena's descriptor.
+void TAlloc_free_arena(talloc_arena_t *arena) {
+	talloc_arena_t *prev = arena->prev;
+	talloc_arena_t *next = arena->next;
+	size_t index = arena->index;
+
+	size_t allocated = state.arenas[index].allocated;
+	if (!munmap(arena, allocated)) {
+		state.mapped -= allocated;
+		if (prev) prev->next = next;
+		else state.arena_head = next;
+		if (next) next->prev = prev;
+		else state.arena_tail = prev;
+		if (index != --state.narenas) {
+			state.arenas[index] = state.arenas[state.narenas];
+			state.arenas[index].arena->index = index;
+		}
+#if TALLOC_POLICY == TALLOC_POLICY_NEXT_FIT
+		// if the rover was on the last arena, it follows it
+		if (state.arena_rover == state.narenas) state.arena_rover = index;
+		if (state.arena_rover >= state.narenas) state.arena_rover = 0;
+#endif
+	}
+}
+
+// When a chunk is freed/updated, we want to merge it with any adjacent
+// empty chunks, so that we have a larger free chunk vs two or more smaller free chunks
+void TAlloc_coalesce(talloc_arena_t *arena, talloc_chunk_t *chunk) {
+	talloc_chunk_t *next = TAlloc_chunk_next(arena, chunk);
+	// ensure the next free chunk starts right after the current chunk before
+	// coalescing/merging them.
+	if (next && (void *) next == (void *) chunk + TAlloc_chunk_size(chunk) + sizeof(talloc_chunk_t)) {
+#if TALLOC_POLICY == TALLOC_POLICY_NEXT_FIT
+		// the rover moves back to the chunk swallowing it, so the next
+		// search resumes right after the merged chunk
+		if (arena->rover == next) arena->rover = chunk;
+#endif
+		TAlloc_set_chunk_size(chunk, TAlloc_chunk_size(chunk) + sizeof(talloc_chunk_t) + TAlloc_chunk_size(next));
+		TAlloc_set_chunk_next(arena, chunk, TAlloc_chunk_next(arena, next));
+	}
+}
+
+// Find the max free space of the arena by looking at all of its free chunks.
+void TAlloc_update_max_free_space(talloc_arena_t *arena) {
+	talloc_arena_desc_t *desc = TAlloc_desc(arena);
+	desc->max_free_space = 0;
+	for (talloc_chunk_t *chunk = arena->free_list; chunk; chunk = TAlloc_chunk_next(arena, chunk)) {
+		if (TAlloc_chunk_size(chunk) > desc->max_free_space) {
+			desc->max_free_space = TAlloc_chunk_size(chunk);
+		}
+	}
+}
+
+#if TALLOC_ENGINE == TALLOC_ENGINE_LIST
+// Purge the pages of a free chunk, except for its header.
+void TAlloc_purge_chunk(talloc_chunk_t *chunk) {
+	TAlloc_purge_range(chunk + 1, (void *) (chunk + 1) + TAlloc_chunk_size(chunk));
+}
+
+// Give the pages at the end of an arena back to the OS if the last free
+// chunk of the arena spans more than TALLOC_TRIM_PAGES of them (or any,
+// under memory pressure). The chunk
+// shrinks to whatever is left in its first page.
+void TAlloc_trim_arena(talloc_arena_t *arena, talloc_chunk_t *chunk) {
+	// pinned arenas keep all their pages
+	if (TAlloc_is_pinned(arena)) return;
+	talloc_arena_desc_t *desc = TAlloc_desc(arena);
+	void *end = (void *) arena + desc->allocated;
+	if (chunk->next || (void *) chunk + sizeof(talloc_chunk_t) + TAlloc_chunk_size(chunk) != end) return;
+
+	size_t keep = (void *) chunk + sizeof(talloc_chunk_t) - (void *) arena;
+	keep = state.pagesize * ((keep + state.pagesize - 1) / state.pagesize);
+	if (desc->allocated - keep < (state.under_pressure ? 1 : state.trim_pages) * state.pagesize) return;
+	if (munmap((void *) arena + keep, desc->allocated - keep)) return;
+	state.mapped -= desc->allocated - keep;
+
+	TAlloc_set_chunk_size(chunk, TAlloc_chunk_size(chunk) - (desc->allocated - keep));
+	desc->allocated = keep;
+	TAlloc_update_max_free_space(arena);
+}
+#endif
+
+// Adjust the max free space of the arena. If a recently freed/updated chunk has more
+// free space than the current "max free space", then we update the arena accordingly.
+void TAlloc_adjust_space_for_new_chunk(talloc_arena_t *arena, talloc_chunk_t *chunk) {
+	talloc_arena_desc_t *desc = TAlloc_desc(arena);
+	if (TAlloc_chunk_size(chunk) > desc->max_free_space) {
+		desc->max_free_space = TAlloc_chunk_size(chunk);
+	}
+}
+
+// Check if a given pointer is inside an arena.
+int TAlloc_ptr_in_arena(talloc_arena_desc_t *desc, void *ptr) {
+	return ptr >= (void *) (desc->arena + 1) && ptr < (void *) desc->arena + desc->allocated;
+}
+
+// Find the arena that contains a given pointer
+talloc_arena_t * TAlloc_find_arena(void *ptr) {
+	for (size_t i = 0; i < state.narenas; ++i) {
+		if (TAlloc_ptr_in_arena(&state.arenas[i], ptr)) return state.arenas[i].arena;
+	}
+	return NULL;
+}
+
+// The number of 64-bit words in the bitmap of a slab. Slabs of a size class
+// are a page, and hold a cache line or more per object; dedicated slabs hold
+// just the one object.
+size_t TAlloc_slab_bitmap_words() {
+	return (state.pagesize / TALLOC_CACHE_LINE + 63) / 64;
+}
+
+// Create a slab arena holding `nslabs` slabs of `slabsize` bytes each, and
+// insert it into the arena linked list. The arena header, the slab
+// descriptors and their bitmaps take the first page(s), so the first slab is
+// page aligned.
+talloc_arena_t * TAlloc_create_slab_arena(size_t nslabs, size_t slabsize) {
+	size_t words = TAlloc_slab_bitmap_words();
+	size_t meta = sizeof(talloc_arena_t) + sizeof(talloc_slab_arena_t) + nslabs * (sizeof(talloc_slab_t) + words * sizeof(uint64_t));
+	meta = state.pagesize * ((meta + state.pagesize - 1) / state.pagesize);
+	if (slabsize > (SIZE_MAX - meta) / nslabs) return NULL;
+
+	// slab arenas never have room for general allocations, so their
+	// descriptor says they have no free space
+	talloc_arena_t *arena = TAlloc_map_arena(meta + nslabs * slabsize, TALLOC_ARENA_SLAB);
+	if (!arena) {
+		return NULL;
+	}
+
+	talloc_slab_arena_t *slab_arena = (talloc_slab_arena_t *) (arena + 1);
+	talloc_slab_t *slabs = (talloc_slab_t *) (slab_arena + 1);
+	slab_arena->nslabs = slab_arena->nunused = nslabs;
+	slab_arena->slabsize = slabsize;
+	slab_arena->slabs = (void *) arena + meta;
+	slab_arena->unused = NULL;
+	// mmap gives us zeroed memory, so the descriptors and bitmaps are
+	// already cleared
+	uint64_t *bitmaps = (uint64_t *) (slabs + nslabs);
+	for (size_t i = nslabs; i > 0; --i) {
+		slabs[i - 1].allocated = bitmaps + (i - 1) * words;
+		slabs[i - 1].next = slab_arena->unused;
+		slab_arena->unused = &slabs[i - 1];
+	}
+
+	TAlloc_link_arena(arena);
+	return arena;
+}
+
+// Assign an unused slab to a size class, and thread its objects into
+// the slab's free list. The first object is offset by the next color
+// of the class.
+void TAlloc_init_slab(talloc_slab_arena_t *slab_arena, talloc_slab_t *slab, talloc_slab_class_t *cls) {
+	slab_arena->unused = slab->next;
+	--slab_arena->nunused;
+
+	size_t index = slab - (talloc_slab_t *) (slab_arena + 1);
+	slab->cls = cls;
+	slab->base = slab_arena->slabs + index * slab_arena->slabsize + cls->next_color * TALLOC_CACHE_LINE;
+	if (++cls->next_color == cls->colors) cls->next_color = 0;
+	slab->inuse = 0;
+	slab->free_objects = NULL;
+	for (size_t i = cls->objects; i > 0; --i) {
+		void *object = slab->base + (i - 1) * cls->size;
+		*(void **) object = slab->free_objects;
+		slab->free_objects = object;
+	}
+
+	// a fresh slab is partial by definition
+	slab->prev = NULL;
+	slab->next = cls->partial;
+	if (cls->partial) cls->partial->prev = slab;
+	cls->partial = slab;
+}
+
+// Find an unused page-sized slab in the existing slab arenas, or create
+// a new slab arena if they are all taken.
+talloc_slab_t * TAlloc_get_unused_slab(talloc_slab_arena_t **slab_arena) {
+	talloc_arena_t *arena = state.arena_head;
+	while (arena) {
+		if (arena->kind == TALLOC_ARENA_SLAB) {
+			*slab_arena = (talloc_slab_arena_t *) (arena + 1);
+			if ((*slab_arena)->unused && (*slab_arena)->slabsize == state.pagesize) {
+				return (*slab_arena)->unused;
+			}
+		}
+		arena = arena->next;
+	}
+
+	arena = TAlloc_create_slab_arena(TALLOC_SLAB_ARENA_PAGES - 1, state.pagesize);
+	if (!arena) return NULL;
+	*slab_arena = (talloc_slab_arena_t *) (arena + 1);
+	return (*slab_arena)->unused;
+}
+
+// Allocate a cache-line aligned object. Sizes are rounded up to a whole number
+// of cache lines, and served from the slabs of the matching size class.
+// Anything bigger than the largest size class gets a slab arena of its own.
+void * TAlloc_slab_malloc(size_t size) {
+	if (size > SIZE_MAX - TALLOC_CACHE_LINE) return NULL;
+	size_t lines = (size + TALLOC_CACHE_LINE - 1) / TALLOC_CACHE_LINE;
+	talloc_slab_class_t *cls;
+	talloc_slab_arena_t *slab_arena;
+
+	if (lines <= TALLOC_SLAB_CLASSES && lines * TALLOC_CACHE_LINE <= state.pagesize) {
+		cls = &state.slab_classes[lines - 1];
+		if (!cls->size) {
+			cls->size = lines * TALLOC_CACHE_LINE;
+			cls->objects = state.pagesize / cls->size;
+			cls->colors = (state.pagesize - cls->objects * cls->size) / TALLOC_CACHE_LINE + 1;
+		}
+		if (!cls->partial) {
+			talloc_slab_t *slab = TAlloc_get_unused_slab(&slab_arena);
+			if (!slab) return NULL;
+			TAlloc_init_slab(slab_arena, slab, cls);
+		}
+	} else {
+		size_t slabsize = (lines * TALLOC_CACHE_LINE + state.pagesize - 1) / state.pagesize;
+		talloc_arena_t *arena = TAlloc_create_slab_arena(1, slabsize * state.pagesize);
+		if (!arena) return NULL;
+		slab_arena = (talloc_slab_arena_t *) (arena + 1);
+		cls = &slab_arena->dedicated;
+		cls->size = slab_arena->slabsize;
+		cls->objects = 1;
+		cls->colors = 1;
+		TAlloc_init_slab(slab_arena, slab_arena->unused, cls);
+	}
+
+	talloc_slab_t *slab = cls->partial;
+	void *object = slab->free_objects;
+	slab->free_objects = *(void **) object;
+	size_t i = (object - slab->base) / cls->size;
+	slab->allocated[i / 64] |= 1ULL << i % 64;
+	if (++slab->inuse == cls->objects) {
+		// the slab is full, so it's no longer partial
+		cls->partial = slab->next;
+		if (slab->next) slab->next->prev = NULL;
+		slab->next = slab->prev = NULL;
+	}
+
+	return object;
+}
+
+// Free an object allocated in a slab arena. When a slab no longer holds any
+// object, it's given back to its arena, and when the arena no longer holds
+// any used slab, the arena itself is released.
+void TAlloc_slab_free(talloc_arena_t *arena, void *ptr) {
+	talloc_slab_arena_t *slab_arena = (talloc_slab_arena_t *) (arena + 1);
+	if (ptr < slab_arena->slabs) return;
+	size_t index = (ptr - slab_arena->slabs) / slab_arena->slabsize;
+	if (index >= slab_arena->nslabs) return;
+
+	talloc_slab_t *slab = (talloc_slab_t *) (slab_arena + 1) + index;
+	talloc_slab_class_t *cls = slab->cls;
+	if (!cls || ptr < slab->base || (ptr - slab->base) % cls->size) return;
+	size_t i = (ptr - slab->base) / cls->size;
+	if (i >= cls->objects || !(slab->allocated[i / 64] & 1ULL << i % 64)) return;
+	slab->allocated[i / 64] &= ~(1ULL << i % 64);
+
+	*(void **) ptr = slab->free_objects;
+	slab->free_objects = ptr;
+	if (slab->inuse-- == cls->objects) {
+		// the slab was full; it's partial again
+		slab->prev = NULL;
+		slab->next = cls->partial;
+		if (cls->partial) cls->partial->prev = slab;
+		cls->partial = slab;
+	}
+	if (slab->inuse) return;
+
+	if (slab->prev) slab->prev->next = slab->next;
+	else cls->partial = slab->next;
+	if (slab->next) slab->next->prev = slab->prev;
+	slab->cls = NULL;
+	slab->prev = NULL;
+	slab->next = slab_arena->unused;
+	slab_arena->unused = slab;
+
+	if (++slab_arena->nunused == slab_arena->nslabs && !TAlloc_is_pinned(arena)) {
+		TAlloc_free_arena(arena);
+	} else if (state.under_pressure) {
+		void *start = slab_arena->slabs + index * slab_arena->slabsize;
+		TAlloc_purge_range(start, start + slab_arena->slabsize);
+	}
+}
+
+#if TALLOC_ENGINE != TALLOC_ENGINE_LIST
+// Turn the requested size into a block size, or 0 if it's too big.
+size_t TAlloc_block_size_for(size_t size) {
+	if (size >= TALLOC_BLOCK_MAX_SIZE) return 0;
+	return size < TALLOC_BLOCK_MIN_SIZE ? TALLOC_BLOCK_MIN_SIZE : TALLOC_PAYLOAD_UP(size);
+}
+
+// Allocate `size` bytes from a free block just taken off its free list.
+// The block is split if the remainder is big enough to make a block of its
+// own, and the remainder goes back to the free lists.
+void * TAlloc_use_block(talloc_arena_t *arena, talloc_block_t *block, size_t size) {
+	size_t block_size = block->size & ~TALLOC_BLOCK_FLAGS;
+	if (block_size - size >= sizeof(talloc_header_t) + TALLOC_BLOCK_MIN_SIZE) {
+		talloc_block_t *rest = (talloc_block_t *) ((void *) block + sizeof(talloc_header_t) + size);
+		rest->size = block_size - size - sizeof(talloc_header_t);
+		block->size = size | (block->size & TALLOC_BLOCK_FLAGS);
+		TAlloc_mark_block_free(rest);
+		TAlloc_insert_block(arena, rest);
+	}
+	TAlloc_mark_block_used(block);
+#if TALLOC_ENGINE == TALLOC_ENGINE_BINS
+	TAlloc_desc(arena)->used += sizeof(talloc_header_t) + (block->size & ~TALLOC_BLOCK_FLAGS);
+#endif
+
+	return (void *) ((talloc_header_t *) block + 1);
+}
+
+// Return a block to the free lists, merging it with its free neighbours.
+// If that leaves the arena with a single free block, the arena is released.
+void TAlloc_free_block(talloc_arena_t *arena, talloc_header_t *header) {
+	talloc_block_t *block = (talloc_block_t *) header;
+	if (block->size & TALLOC_BLOCK_PREV_FREE) {
+		talloc_block_t *prev = *((talloc_block_t **) block - 1);
+		TAlloc_remove_block(arena, prev);
+		prev->size += sizeof(talloc_header_t) + (block->size & ~TALLOC_BLOCK_FLAGS);
+		block = prev;
+	}
+	talloc_block_t *next = TAlloc_next_block(block);
+	if (next->size & TALLOC_BLOCK_FREE) {
+		TAlloc_remove_block(arena, next);
+		block->size += sizeof(talloc_header_t) + (next->size & ~TALLOC_BLOCK_FLAGS);
+	}
+	TAlloc_mark_block_free(block);
+
+	// we release the occupied space if no longer needed, or else
+	// give back the free pages at the end of the arena (pinned arenas
+	// are kept as they are)
+	if (!(TAlloc_next_block(block)->size & ~TALLOC_BLOCK_FLAGS)) {
+		if (block == TAlloc_first_block(arena) && !TAlloc_is_pinned(arena)) {
+			TAlloc_free_arena(arena);
+			return;
+		}
+		TAlloc_trim_arena(arena, block);
+	}
+	if (state.under_pressure) TAlloc_purge_block(block);
+	TAlloc_insert_block(arena, block);
+}
+#endif
+
+#if TALLOC_ENGINE == TALLOC_ENGINE_TLSF
+// Allocate a block from the TLSF free lists, creating a new arena if none
+// of them is big enough.
+void * TAlloc_tlsf_malloc(size_t size) {
+	size = TAlloc_block_size_for(size);
+	if (!size) return NULL;
+
+	// big requests get an arena of their own, which goes away when freed
+	talloc_block_t *block = size < state.mmap_threshold ? TAlloc_tlsf_find(size) : NULL;
+	if (!block) {
+		// the new arena holds a single free block, big enough by construction
+		talloc_arena_t *arena = TAlloc_alloc_more_space(size);
+		if (!arena) return NULL;
+		block = TAlloc_first_block(arena);
+	}
+	TAlloc_remove_block(NULL, block);
+	return TAlloc_use_block(NULL, block, size);
+}
+#endif
+
+// Push a free block of the given order into its free list.
+void TAlloc_buddy_push(talloc_buddy_arena_t *buddy_arena, talloc_buddy_block_t *block, size_t order) {
+	buddy_arena->orders[((void *) block - buddy_arena->pool) / state.pagesize] = order | TALLOC_BUDDY_FREE;
+	block->prev = NULL;
+	block->next = buddy_arena->free_lists[order];
+	if (block->next) block->next->prev = block;
+	buddy_arena->free_lists[order] = block;
+	buddy_arena->free_orders |= 1U << order;
+}
+
+// Remove a free block of the given order from its free list.
+void TAlloc_buddy_remove(talloc_buddy_arena_t *buddy_arena, talloc_buddy_block_t *block, size_t order) {
+	if (block->next) block->next->prev = block->prev;
+	if (block->prev) {
+		block->prev->next = block->next;
+	} else {
+		buddy_arena->free_lists[order] = block->next;
+		if (!block->next) buddy_arena->free_orders &= ~(1U << order);
+	}
+}
+
+// Create a buddy arena holding TALLOC_BUDDY_ARENA_BLOCKS free blocks of the
+// largest order, and insert it into the arena linked list.
+talloc_arena_t * TAlloc_create_buddy_arena() {
+	size_t maxorder = 0;
+	while ((state.pagesize << (maxorder + 1)) <= TALLOC_BUDDY_MAX) ++maxorder;
+	size_t npages = TALLOC_BUDDY_ARENA_BLOCKS << maxorder;
+	size_t meta = sizeof(talloc_arena_t) + sizeof(talloc_buddy_arena_t) + npages;
+	meta = state.pagesize * ((meta + state.pagesize - 1) / state.pagesize);
+
+	// buddy arenas never have room for general allocations either
+	talloc_arena_t *arena = TAlloc_map_arena(meta + npages * state.pagesize, TALLOC_ARENA_BUDDY);
+	if (!arena) {
+		return NULL;
+	}
+
+	// mmap gives us zeroed memory, so the free lists are already empty
+	talloc_buddy_arena_t *buddy_arena = (talloc_buddy_arena_t *) (arena + 1);
+	buddy_arena->maxorder = maxorder;
+	buddy_arena->npages = npages;
+	buddy_arena->pool = (void *) arena + meta;
+	for (size_t i = 0; i < npages; ++i) buddy_arena->orders[i] = TALLOC_BUDDY_FREE;
+	for (size_t i = TALLOC_BUDDY_ARENA_BLOCKS; i > 0; --i) {
+		void *block = buddy_arena->pool + ((i - 1) << maxorder) * state.pagesize;
+		TAlloc_buddy_push(buddy_arena, block, maxorder);
+	}
+
+	TAlloc_link_arena(arena);
+	return arena;
+}
+
+// Allocate a block of 2^n pages from the first buddy arena that has a free
+// block of order n or above, splitting the block found in halves until it
+// has the right order. The upper halves go to the free lists.
+void * TAlloc_buddy_malloc(size_t size) {
+	size_t pages = (size + state.pagesize - 1) / state.pagesize;
+	size_t order = pages <= 1 ? 0 : 64 - __builtin_clzll(pages - 1);
+
+	talloc_buddy_arena_t *buddy_arena = NULL;
+	talloc_arena_t *arena = state.arena_head;
+	while (arena) {
+		if (arena->kind == TALLOC_ARENA_BUDDY) {
+			buddy_arena = (talloc_buddy_arena_t *) (arena + 1);
+			if (buddy_arena->free_orders >> order) break;
+		}
+		arena = arena->next;
+	}
+	if (!arena) {
+		arena = TAlloc_create_buddy_arena();
+		if (!arena) return NULL;
+		buddy_arena = (talloc_buddy_arena_t *) (arena + 1);
+	}
+
+	size_t found = __builtin_ctz(buddy_arena->free_orders >> order) + order;
+	talloc_buddy_block_t *block = buddy_arena->free_lists[found];
+	TAlloc_buddy_remove(buddy_arena, block, found);
+	while (found > order) {
+		--found;
+		TAlloc_buddy_push(buddy_arena, (void *) block + (state.pagesize << found), found);
+	}
+
+	buddy_arena->orders[((void *) block - buddy_arena->pool) / state.pagesize] = order;
+	buddy_arena->used += (size_t) 1 << order;
+	return block;
+}
+
+// Free a block allocated in a buddy arena, merging it with its buddy for as
+// long as the buddy is free too. When the arena no longer holds any used
+// block, it's released.
+void TAlloc_buddy_free(talloc_arena_t *arena, void *ptr) {
+	talloc_buddy_arena_t *buddy_arena = (talloc_buddy_arena_t *) (arena + 1);
+	if (ptr < buddy_arena->pool || (ptr - buddy_arena->pool) % state.pagesize) return;
+	size_t index = (ptr - buddy_arena->pool) / state.pagesize;
+	size_t order = buddy_arena->orders[index];
+	if (order & TALLOC_BUDDY_FREE || index & (((size_t) 1 << order) - 1)) return;
+	// mark it free right away: if it merges with its buddy below, its first
+	// page is no longer the first page of a block, and a second free of it
+	// has to be turned down all the same
+	buddy_arena->orders[index] = order | TALLOC_BUDDY_FREE;
+
+	buddy_arena->used -= (size_t) 1 << order;
+	if (!buddy_arena->used && !TAlloc_is_pinned(arena)) {
+		TAlloc_free_arena(arena);
+		return;
+	}
+
+	while (order < buddy_arena->maxorder) {
+		size_t buddy = index ^ ((size_t) 1 << order);
+		if (buddy_arena->orders[buddy] != (order | TALLOC_BUDDY_FREE)) break;
+		TAlloc_buddy_remove(buddy_arena, buddy_arena->pool + buddy * state.pagesize, order);
+		if (buddy < index) index = buddy;
+		++order;
+	}
+	void *block = buddy_arena->pool + index * state.pagesize;
+	TAlloc_buddy_push(buddy_arena, block, order);
+	// the first page holds the free list links
+	if (state.under_pressure) TAlloc_purge_range(block + state.pagesize, block + (state.pagesize << order));
+}
+
+// Purge the free pages of all arenas: those of free chunks, unused slabs
+// and free buddy blocks. Called with the lock held.
+void TAlloc_purge_unlocked() {
+	for (size_t i = 0; i < state.narenas; ++i) {
+		talloc_arena_t *arena = state.arenas[i].arena;
+		if (arena->kind == TALLOC_ARENA_SLAB) {
+			talloc_slab_arena_t *slab_arena = (talloc_slab_arena_t *) (arena + 1);
+			talloc_slab_t *slabs = (talloc_slab_t *) (slab_arena + 1);
+			for (talloc_slab_t *slab = slab_arena->unused; slab; slab = slab->next) {
+				void *start = slab_arena->slabs + (slab - slabs) * slab_arena->slabsize;
+				TAlloc_purge_range(start, start + slab_arena->slabsize);
+			}
+		} else if (arena->kind == TALLOC_ARENA_BUDDY) {
+			talloc_buddy_arena_t *buddy_arena = (talloc_buddy_arena_t *) (arena + 1);
+			for (size_t order = 0; order <= buddy_arena->maxorder; ++order) {
+				for (talloc_buddy_block_t *block = buddy_arena->free_lists[order]; block; block = block->next) {
+					TAlloc_purge_range((void *) block + state.pagesize, (void *) block + (state.pagesize << order));
+				}
+			}
+		} else {
+#if TALLOC_ENGINE != TALLOC_ENGINE_LIST
+			for (talloc_block_t *block = TAlloc_first_block(arena); block->size & ~TALLOC_BLOCK_FLAGS; block = TAlloc_next_block(block)) {
+				if (block->size & TALLOC_BLOCK_FREE) TAlloc_purge_block(block);
+			}
+#else
+			for (talloc_chunk_t *chunk = arena->free_list; chunk; chunk = TAlloc_chunk_next(arena, chunk)) TAlloc_purge_chunk(chunk);
+#endif
+		}
+	}
+}
+
+// Purge the free pages of all arenas.
+void TAlloc_purge() {
+	TAlloc_lock(&state.lock);
+	TAlloc_purge_unlocked();
+	TAlloc_unlock(&state.lock);
+}
+
+// Read the pressure source set with TAlloc_set_pressure_file. This can be
+// a cgroup v2 memory.pressure file (pressure when "some avg10" reaches
+// TALLOC_PRESSURE_AVG10), a memory.events file (pressure when the "high"
+// count went up since the last read), or any file holding a number
+// (pressure when it's not zero).
+int TAlloc_read_pressure(const char *path) {
+	char buf[512];
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return 0;
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) return 0;
+	buf[n] = 0;
+
+	char *p = buf;
+	unsigned long long value = 0;
+	if (p[0] == 's' && p[1] == 'o' && p[2] == 'm' && p[3] == 'e') {
+		while (*p && !(p[0] == 'a' && p[1] == 'v' && p[2] == 'g' && p[3] == '1' && p[4] == '0' && p[5] == '=')) ++p;
+		if (!*p) return 0;
+		for (p += 6; *p >= '0' && *p <= '9'; ++p) value = value * 10 + (*p - '0');
+		return value >= TALLOC_PRESSURE_AVG10;
+	}
+	while (*p && !(p[0] == 'h' && p[1] == 'i' && p[2] == 'g' && p[3] == 'h' && p[4] == ' ')) {
+		while (*p && *p != '\n') ++p;
+		if (*p) ++p;
+	}
+	if (*p) {
+		for (p += 5; *p >= '0' && *p <= '9'; ++p) value = value * 10 + (*p - '0');
+		return value > __atomic_exchange_n(&state.pressure_events, value, __ATOMIC_RELAXED);
+	}
+	for (p = buf; *p >= '0' && *p <= '9'; ++p) value = value * 10 + (*p - '0');
+	return value != 0;
+}
+
+#if TALLOC_THREADS
+// defined further down
+void TAlloc_tcache_drain_all();
+#endif
+
+// Check the pressure source now. When memory comes under pressure, thread
+// caches and the depot are emptied and the free pages of all arenas are
+// purged, and until it clears, freed blocks skip the thread caches, the
+// pages of every chunk that gets freed are purged as well, and arenas are
+// trimmed down to the last page. Returns whether memory is under pressure.
+//
+// The source is read without the lock, so the callback may allocate.
+int TAlloc_poll_pressure() {
+	__atomic_store_n(&state.pressure_countdown, TALLOC_PRESSURE_INTERVAL, __ATOMIC_RELAXED);
+	int (*callback)(void) = __atomic_load_n(&state.pressure_callback, __ATOMIC_RELAXED);
+	const char *file = __atomic_load_n(&state.pressure_file, __ATOMIC_RELAXED);
+	int pressure = 0;
+	if (callback) pressure = callback();
+	else if (file) pressure = TAlloc_read_pressure(file);
+	else return 0;
+
+	TAlloc_lock(&state.lock);
+	if (pressure && !state.under_pressure) {
+		state.under_pressure = 1;
+#if TALLOC_THREADS
+		TAlloc_tcache_drain_all();
+#endif
+		TAlloc_purge_unlocked();
+	} else if (!pressure) {
+		state.under_pressure = 0;
+	}
+	pressure = state.under_pressure;
+	TAlloc_unlock(&state.lock);
+	return pressure;
+}
+
+// Count a call to TAlloc_malloc or TAlloc_free, and poll the pressure
+// source if it's time to. Called without the lock.
+void TAlloc_tick_pressure() {
+	if (!__atomic_load_n(&state.pressure_file, __ATOMIC_RELAXED) && !__atomic_load_n(&state.pressure_callback, __ATOMIC_RELAXED)) return;
+	if (!__atomic_fetch_sub(&state.pressure_countdown, 1, __ATOMIC_RELAXED)) TAlloc_poll_pressure();
+}
+
+// Watch a file for memory pressure, typically the memory.pressure or
+// memory.events file of the process' cgroup. The path isn't copied, so it
+// must stay valid. NULL stops watching.
+void TAlloc_set_pressure_file(const char *path) {
+	TAlloc_lock(&state.lock);
+	__atomic_store_n(&state.pressure_file, path, __ATOMIC_RELAXED);
+	__atomic_store_n(&state.pressure_countdown, 0, __ATOMIC_RELAXED);
+	if (!path) state.under_pressure = 0;
+	TAlloc_unlock(&state.lock);
+}
+
+// Ask a function whether memory is under pressure, instead of reading a
+// file. NULL goes back to the file, if any.
+void TAlloc_set_pressure_callback(int (*callback)(void)) {
+	TAlloc_lock(&state.lock);
+	__atomic_store_n(&state.pressure_callback, callback, __ATOMIC_RELAXED);
+	__atomic_store_n(&state.pressure_countdown, 0, __ATOMIC_RELAXED);
+	if (!callback && !state.pressure_file) state.under_pressure = 0;
+	TAlloc_unlock(&state.lock);
+}
+
+// The tag of an allocated chunk, or -1 if the header isn't valid. Tagged
+// chunks have the tag mixed into their magic, so untagged ones (tag 0)
+// keep TALLOC_MAGIC as it is.
+int TAlloc_header_tag(talloc_header_t *header) {
+#ifdef TALLOC_CHECK_SHIFT
+	// free blocks keep their check, so the flag tells them apart
+	if (header->size & TALLOC_BLOCK_FREE) return -1;
+#endif
+	uintptr_t tag = TAlloc_header_magic(header) ^ TALLOC_HEADER_MAGIC;
+	return tag < TALLOC_TAGS ? (int) tag : -1;
+}
+
+// The shard of the tag counters this thread updates. Threads get shards
+// round robin, the first time they allocate or free tagged memory.
+talloc_tag_shard_t * TAlloc_tag_shard() {
+	if (!talloc_tag_shard) {
+		talloc_tag_shard = __atomic_fetch_add(&state.tag_threads, 1, __ATOMIC_RELAXED) % TALLOC_TAG_SHARDS + 1;
+	}
+	return &state.tag_shards[talloc_tag_shard - 1];
+}
+
+// How many bytes are allocated with the given tag, headers included.
+size_t TAlloc_tag_usage(int tag) {
+	if (tag <= 0 || tag >= TALLOC_TAGS) return 0;
+	size_t live = 0;
+	for (int i = 0; i < TALLOC_TAG_SHARDS; ++i) {
+		live += __atomic_load_n(&state.tag_shards[i].live[tag], __ATOMIC_RELAXED);
+	}
+	return live;
+}
+
+// Check whether the quota of a tag leaves room for the given size.
+int TAlloc_tag_admits(int tag, size_t size) {
+	size_t quota = state.tag_quotas[tag];
+	if (!quota) return 1;
+	size_t live = TAlloc_tag_usage(tag) + sizeof(talloc_header_t);
+	return live <= quota && size <= quota - live;
+}
+
+// Mark an allocated chunk with a tag and add its size to the tag's
+// counter (`sign` 1), or take it off again when it's freed (`sign` -1).
+void TAlloc_tag_charge(talloc_header_t *header, int tag, int sign) {
+#if TALLOC_ENGINE != TALLOC_ENGINE_LIST
+	size_t size = sizeof(talloc_header_t) + (header->size & ~TALLOC_BLOCK_FLAGS);
+#else
+	size_t size = sizeof(talloc_header_t) + header->size;
+#endif
+	TAlloc_set_header_magic(header, TALLOC_HEADER_MAGIC ^ (sign > 0 ? (uintptr_t) tag : 0));
+	__atomic_fetch_add(&TAlloc_tag_shard()->live[tag], sign > 0 ? size : -size, __ATOMIC_RELAXED);
+}
+
+// Set the tag the allocations of the calling thread are charged to, and
+// return the previous one. Tag 0 stops charging. Returns -1, and changes
+// nothing, if the tag is out of range.
+int TAlloc_set_tag(int tag) {
+	if (tag < 0 || tag >= TALLOC_TAGS) return -1;
+	int previous = talloc_current_tag;
+	talloc_current_tag = tag;
+	return previous;
+}
+
+// Limit the bytes allocated with a tag, headers included. Once the limit
+// is reached, allocations with that tag fail right away instead of growing
+// the heap. A quota of 0 removes the limit.
+int TAlloc_set_tag_quota(int tag, size_t quota) {
+	if (tag <= 0 || tag >= TALLOC_TAGS) return -1;
+	TAlloc_lock(&state.lock);
+	state.tag_quotas[tag] = quota;
+	TAlloc_unlock(&state.lock);
+	return 0;
+}
+
+// Return an allocated chunk of a general arena to its free lists, and
+// coalesce it with any adjacent free chunks.
+void TAlloc_free_general(talloc_arena_t *arena, talloc_header_t *header) {
+#if TALLOC_ENGINE != TALLOC_ENGINE_LIST
+#if TALLOC_ENGINE == TALLOC_ENGINE_BINS
+	TAlloc_desc(arena)->used -= sizeof(talloc_header_t) + (header->size & ~TALLOC_BLOCK_FLAGS);
+#endif
+	TAlloc_free_block(arena, header);
+#else
+	talloc_chunk_t *chunk = (talloc_chunk_t *) header;
+	talloc_chunk_t *last = chunk;
+	talloc_arena_desc_t *desc = TAlloc_desc(arena);
+	size_t size = header->size;
+	desc->used -= sizeof(talloc_header_t) + size;
+	TAlloc_set_chunk_size(chunk, sizeof(talloc_header_t) + size - sizeof(talloc_chunk_t));
+
+	// chunks are sorted based on their address to make coalescing easier
+	if (!arena->free_list) {
+		arena->free_list = chunk;
+		TAlloc_set_chunk_next(arena, chunk, NULL);
+		desc->max_free_space = TAlloc_chunk_size(chunk);
+	} else if (chunk < arena->free_list) {
+		TAlloc_set_chunk_next(arena, chunk, arena->free_list);
+		arena->free_list = chunk;
+		TAlloc_coalesce(arena, chunk);
+		TAlloc_adjust_space_for_new_chunk(arena, chunk);
+	} else {
+		talloc_chunk_t *insert_after = arena->free_list;
+		talloc_chunk_t *next;
+		while ((next = TAlloc_chunk_next(arena, insert_after)) && next < chunk) {
+			insert_after = next;
+		}
+		TAlloc_set_chunk_next(arena, chunk, next);
+		TAlloc_set_chunk_next(arena, insert_after, chunk);
+		TAlloc_coalesce(arena, chunk);
+		TAlloc_adjust_space_for_new_chunk(arena, chunk);
+		TAlloc_coalesce(arena, insert_after);
+		TAlloc_adjust_space_for_new_chunk(arena, insert_after);
+		// the freed chunk may have been merged into the one before it
+		last = TAlloc_chunk_next(arena, insert_after) == chunk ? chunk : insert_after;
+	}
+
+	// we release the occupied space if no longer needed, or else
+	// give back the free pages at the end of the arena (pinned arenas
+	// are kept as they are)
+	if (desc->allocated == desc->max_free_space + TALLOC_ARENA_OVERHEAD && !TAlloc_is_pinned(arena)) {
+		TAlloc_free_arena(arena);
+	} else {
+		TAlloc_trim_arena(arena, last);
+		if (state.under_pressure) TAlloc_purge_chunk(last);
+	}
+#endif
+}
+
+#if TALLOC_THREADS
+// The current time, in milliseconds.
+uint64_t TAlloc_now_ms() {
+	return TAlloc_now_ns() / 1000000;
+}
+
+// Give up to `n` blocks of a size class of a thread cache back to the
+// heap. Called with the lock held.
+void TAlloc_tcache_flush(talloc_tcache_t *cache, int class, unsigned int n) {
+	for (; n && cache->bins[class]; --n) {
+		void *ptr = cache->bins[class];
+		cache->bins[class] = *(void **) ptr;
+		--cache->count[class];
+		TAlloc_set_header_magic((talloc_header_t *) ptr - 1, TALLOC_HEADER_MAGIC);
+		TAlloc_free_general(TAlloc_find_arena(ptr), (talloc_header_t *) ptr - 1);
+	}
+	if (cache->low[class] > cache->count[class]) cache->low[class] = cache->count[class];
+}
+
+// Push a magazine onto the depot of a size class.
+void TAlloc_depot_push(int class, void *magazine) {
+	talloc_depot_t *depot = &state.depot[class];
+	void *head = __atomic_load_n(&depot->magazines, __ATOMIC_RELAXED);
+	do {
+		((void **) magazine)[1] = head;
+	} while (!__atomic_compare_exchange_n(&depot->magazines, &head, magazine, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	__atomic_fetch_add(&depot->count, 1, __ATOMIC_RELAXED);
+	// the age of a depot counts from its oldest magazine nobody took
+	if (!head) __atomic_store_n(&depot->used_time, TAlloc_now_ms(), __ATOMIC_RELAXED);
+}
+
+// Take a magazine from the depot of a size class, or NULL if it's empty
+// (or another thread is taking one right now).
+void * TAlloc_depot_take(int class) {
+	talloc_depot_t *depot = &state.depot[class];
+	if (!__atomic_load_n(&depot->magazines, __ATOMIC_RELAXED)) return NULL;
+	void *magazine = __atomic_exchange_n(&depot->magazines, NULL, __ATOMIC_ACQUIRE);
+	if (!magazine) return NULL;
+	__atomic_fetch_sub(&depot->count, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&depot->used_time, TAlloc_now_ms(), __ATOMIC_RELAXED);
+
+	// put the others back, in front of whatever was pushed meanwhile
+	void *rest = ((void **) magazine)[1];
+	if (rest) {
+		void *last = rest;
+		while (((void **) last)[1]) last = ((void **) last)[1];
+		void *head = __atomic_load_n(&depot->magazines, __ATOMIC_RELAXED);
+		do {
+			((void **) last)[1] = head;
+		} while (!__atomic_compare_exchange_n(&depot->magazines, &head, rest, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	return magazine;
+}
+
+// Give up to `n` magazines of the depot of a size class back to the heap.
+// Called with the lock held.
+void TAlloc_depot_drain(int class, unsigned int n) {
+	for (void *magazine; n && (magazine = TAlloc_depot_take(class)); --n) {
+		while (magazine) {
+			void *next = *(void **) magazine;
+			TAlloc_set_header_magic((talloc_header_t *) magazine - 1, TALLOC_HEADER_MAGIC);
+			TAlloc_free_general(TAlloc_find_arena(magazine), (talloc_header_t *) magazine - 1);
+			magazine = next;
+		}
+	}
+}
+
+// Move a batch of blocks, half of a full size class, from a thread cache
+// to the depot, where threads that run short can take them. If the depot
+// is full, the blocks go back to the heap. Called with the lock held.
+void TAlloc_tcache_spill(talloc_tcache_t *cache, int class) {
+	unsigned int n = cache->count[class] > 1 ? cache->count[class] / 2 : 1;
+	if (__atomic_load_n(&state.depot[class].count, __ATOMIC_RELAXED) >= TALLOC_DEPOT_MAGAZINES) {
+		TAlloc_tcache_flush(cache, class, n);
+		return;
+	}
+	void *magazine = cache->bins[class];
+	void *last = magazine;
+	for (unsigned int i = 1; i < n; ++i) last = *(void **) last;
+	cache->bins[class] = *(void **) last;
+	*(void **) last = NULL;
+	cache->count[class] -= n;
+	if (cache->low[class] > cache->count[class]) cache->low[class] = cache->count[class];
+	TAlloc_depot_push(class, magazine);
+}
+
+// Give back half of what each size class of a cache didn't need since its
+// last collection. Called with the lock held, and, for the cache of
+// another thread, with its `busy` flag.
+void TAlloc_tcache_collect(talloc_tcache_t *cache, uint64_t now) {
+	cache->gc_time = now;
+	for (int class = 0; class < TALLOC_TCACHE_CLASSES; ++class) {
+		TAlloc_tcache_flush(cache, class, (cache->low[class] + 1) / 2);
+		cache->low[class] = cache->count[class];
+	}
+}
+
+// Collect the thread cache once every state.tcache_gc_ms milliseconds. A
+// burst of allocations on a thread fills its cache, and this lets it drain
+// again bit by bit afterwards. A thread that went quiet doesn't get here,
+// so the caches that weren't collected for a whole interval are collected
+// along the way, unless their owner is busy with them. Called with the
+// lock held.
+void TAlloc_tcache_gc() {
+	talloc_tcache_t *cache = &talloc_tcache;
+	if (++cache->ticks < TALLOC_TCACHE_GC_TICKS || !state.tcache_gc_ms) return;
+	cache->ticks = 0;
+	uint64_t now = TAlloc_now_ms();
+	if (now - cache->gc_time < state.tcache_gc_ms) return;
+	TAlloc_tcache_collect(cache, now);
+	for (talloc_tcache_t *other = __atomic_load_n(&state.caches, __ATOMIC_ACQUIRE); other; other = other->next_cache) {
+		if (other == cache || now - other->gc_time < state.tcache_gc_ms) continue;
+		if (__atomic_exchange_n(&other->busy, 1, __ATOMIC_ACQUIRE)) continue;
+		TAlloc_tcache_collect(other, now);
+		__atomic_store_n(&other->busy, 0, __ATOMIC_RELEASE);
+	}
+
+	// a magazine nobody wanted for a whole interval goes back too; the
+	// depots are shared, so this goes by a clock of their own, not by how
+	// many threads collect their caches
+	if (now - state.depot_gc_time < state.tcache_gc_ms) return;
+	state.depot_gc_time = now;
+	for (int class = 0; class < TALLOC_TCACHE_CLASSES; ++class) {
+		if (now - __atomic_load_n(&state.depot[class].used_time, __ATOMIC_RELAXED) >= state.tcache_gc_ms) {
+			TAlloc_depot_drain(class, 1);
+		}
+	}
+}
+
+// Give every thread cache, and the depot, back to the heap, when memory
+// comes under pressure. An owner holds the `busy` flag of its cache only
+// for a moment, so this waits for it. Called with the lock held.
+void TAlloc_tcache_drain_all() {
+	for (int class = 0; class < TALLOC_TCACHE_CLASSES; ++class) TAlloc_depot_drain(class, ~0U);
+	for (talloc_tcache_t *cache = __atomic_load_n(&state.caches, __ATOMIC_ACQUIRE); cache; cache = cache->next_cache) {
+		while (__atomic_exchange_n(&cache->busy, 1, __ATOMIC_ACQUIRE)) TAlloc_cpu_relax();
+		for (int class = 0; class < TALLOC_TCACHE_CLASSES; ++class) {
+			TAlloc_tcache_flush(cache, class, cache->count[class]);
+		}
+		__atomic_store_n(&cache->busy, 0, __ATOMIC_RELEASE);
+	}
+}
+
+// Make sure the cache goes back to the heap when its thread exits, and
+// that other threads can collect it. This doesn't need the lock.
+void TAlloc_tcache_register(talloc_tcache_t *cache) {
+	if (!cache->registered) {
+		pthread_setspecific(state.tcache_key, cache);
+		cache->registered = 1;
+		cache->next_cache = __atomic_load_n(&state.caches, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&state.caches, &cache->next_cache, cache, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+}
 
-	return arena;
+// Take a cache off state.caches. Called with the lock held, so only
+// threads registering their cache can change the list meanwhile, and they
+// only ever replace its head.
+void TAlloc_tcache_unregister(talloc_tcache_t *cache) {
+	if (!cache->registered) return;
+	talloc_tcache_t *head = cache;
+	if (!__atomic_compare_exchange_n(&state.caches, &head, cache->next_cache, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		while (head->next_cache != cache) head = head->next_cache;
+		head->next_cache = cache->next_cache;
+	}
+	cache->registered = 0;
 }
 
-// Frees an arena. This is called when an arena (not the first one) is
-// no longer needed. We simply remove it from the linked list, and unmap it.
-void TAlloc_free_arena(talloc_arena_t *arena) {
-	talloc_arena_t *prev = arena->prev;
-	talloc_arena_t *next = arena->next;
+// Put an untagged block that is being freed in the thread cache, if it's
+// small enough. If its size class is full, half of it goes to the depot
+// first. The block stays allocated as far as its arena is concerned, but
+// gets TALLOC_CACHED_MAGIC until it's handed out again. Returns whether the
+// block was taken.
+int TAlloc_tcache_put(talloc_header_t *header) {
+	if (!state.tcache_count || state.under_pressure || talloc_tcache.uncached || talloc_tcache.exited) return 0;
+#if TALLOC_ENGINE != TALLOC_ENGINE_LIST
+	size_t size = header->size & ~TALLOC_BLOCK_FLAGS;
+#else
+	size_t size = header->size;
+#endif
+	// blocks go to the biggest class they can serve
+	size_t class = size / TALLOC_ALIGNMENT;
+	if (class == 0 || class > TALLOC_TCACHE_CLASSES) return 0;
+	--class;
+	talloc_tcache_t *cache = &talloc_tcache;
+	if (cache->count[class] >= state.tcache_count) TAlloc_tcache_spill(cache, class);
+	TAlloc_tcache_register(cache);
+	TAlloc_set_header_magic(header, TALLOC_CACHED_MAGIC);
+	*(void **) (header + 1) = cache->bins[class];
+	cache->bins[class] = header + 1;
+	++cache->count[class];
+	return 1;
+}
 
-	if (!munmap(arena, arena->allocated)) {
-		prev->next = next;
-		if (next) next->prev = prev;
+// Take a block for the given size class from the thread cache, refilling
+// it from the depot if it's empty, or return NULL if both are, or if
+// another thread is collecting the cache right now. This doesn't need the
+// lock.
+void * TAlloc_tcache_get(int class) {
+	talloc_tcache_t *cache = &talloc_tcache;
+	if (__atomic_exchange_n(&cache->busy, 1, __ATOMIC_ACQUIRE)) return NULL;
+	void *ptr = cache->bins[class];
+	if (!ptr && !cache->exited && (ptr = TAlloc_depot_take(class))) {
+		TAlloc_tcache_register(cache);
+		cache->bins[class] = ptr;
+		for (void *block = ptr; block; block = *(void **) block) ++cache->count[class];
+	}
+	if (ptr) {
+		cache->bins[class] = *(void **) ptr;
+		if (--cache->count[class] < cache->low[class]) cache->low[class] = cache->count[class];
+		TAlloc_set_header_magic((talloc_header_t *) ptr - 1, TALLOC_HEADER_MAGIC);
 	}
+	__atomic_store_n(&cache->busy, 0, __ATOMIC_RELEASE);
+	return ptr;
 }
 
-// When a chunk is freed/updated, we want to merge it with any adjacent
-// empty chunks, so that we have a larger free chunk vs two or more smaller free chunks
-void TAlloc_coalesce(talloc_chunk_t *chunk) {
-	// ensure the next free chunk starts right after the current chunk before
-	// coalescing/merging them.
-	if (chunk->next == (void *) chunk + chunk->size + sizeof(talloc_chunk_t)) {
-		chunk->size += sizeof(talloc_chunk_t) + chunk->next->size;
-		chunk->next = chunk->next->next;
+// defined further down
+size_t TAlloc_free_chain(void *block);
+
+// Give a thread's whole cache back to the heap, and take it off
+// state.caches. Deferred frees that weren't handed over yet are done right
+// here. Called by the owner, with the lock held.
+void TAlloc_tcache_release(talloc_tcache_t *cache) {
+	if (cache->deferred) __atomic_fetch_sub(&state.deferred_batches, 1, __ATOMIC_RELAXED);
+	TAlloc_free_chain(cache->deferred);
+	cache->deferred = NULL;
+	cache->ndeferred = 0;
+	for (int class = 0; class < TALLOC_TCACHE_CLASSES; ++class) {
+		TAlloc_tcache_flush(cache, class, cache->count[class]);
 	}
+	TAlloc_tcache_unregister(cache);
 }
 
-// Adjust the max free space of the arena. If a recently freed/updated chunk has more
-// free space than the current "max free space", then we update the arena accordingly.
-void TAlloc_adjust_space_for_new_chunk(talloc_arena_t *arena, talloc_chunk_t *chunk) {
-	if (chunk->size > arena->max_free_space) {
-		arena->max_free_space = chunk->size;
-	}
+// The pthread key destructor: give a thread's whole cache back to the heap
+// when the thread exits, so that memory isn't stranded in dead threads.
+// Frees after this (from other destructors, say) skip the cache, since it
+// goes away with the thread.
+void TAlloc_tcache_destroy(void *cache) {
+	TAlloc_lock(&state.lock);
+	TAlloc_tcache_release(cache);
+	((talloc_tcache_t *) cache)->exited = 1;
+	TAlloc_unlock(&state.lock);
 }
+#endif
 
-// Check if a given pointer is inside an arena.
-int TAlloc_ptr_in_arena(talloc_arena_t *arena, void *ptr) {
-	return ptr >= (void *) (arena + 1) && ptr < (void *) arena + arena->allocated;
+#if TALLOC_THREADS
+// Give the calling thread's cache, and whatever waits in the depot or for
+// the reclaimer, back to the heap, say before the thread goes idle for a
+// long time.
+void TAlloc_thread_flush() {
+	if (!TAlloc_is_initialized()) return;
+	TAlloc_lock(&state.lock);
+	TAlloc_tcache_release(&talloc_tcache);
+	for (int class = 0; class < TALLOC_TCACHE_CLASSES; ++class) TAlloc_depot_drain(class, ~0U);
+	size_t n = TAlloc_free_chain(__atomic_exchange_n(&state.deferred, NULL, __ATOMIC_ACQUIRE));
+	__atomic_fetch_sub(&state.deferred_count, n, __ATOMIC_RELAXED);
+	TAlloc_unlock(&state.lock);
 }
+#endif
 
-// Find the arena that contains a given pointer
-talloc_arena_t * TAlloc_find_arena(void *ptr) {
-	talloc_arena_t *arena = state.arena_head;
-	while (arena && !TAlloc_ptr_in_arena(arena, ptr)) arena = arena->next;
-	return arena;
+// Free the allocated memory at the given pointer, with the lock held.
+void TAlloc_free_unlocked(void *ptr) {
+	talloc_arena_t *arena = TAlloc_find_arena(ptr);
+	if (!arena) return;
+	if (arena->kind == TALLOC_ARENA_SLAB) {
+		TAlloc_slab_free(arena, ptr);
+		return;
+	}
+	if (arena->kind == TALLOC_ARENA_BUDDY) {
+		TAlloc_buddy_free(arena, ptr);
+		return;
+	}
+
+	talloc_header_t *header = (talloc_header_t *) ptr - 1;
+	int tag = TAlloc_header_tag(header);
+	if (tag < 0) {
+		return;
+	}
+	if (tag) TAlloc_tag_charge(header, tag, -1);
+#if TALLOC_THREADS
+	TAlloc_tcache_gc();
+	if (!tag && TAlloc_tcache_put(header)) return;
+#endif
+	TAlloc_free_general(arena, header);
 }
 
 // Free the allocated memory at the given pointer. This will do some basic
@@ -182,167 +2290,862 @@ talloc_arena_t * TAlloc_find_arena(void *ptr) {
 // an arena, and that the header's magic holds the correct value.
 // Finally it will coalesce any adjacent free chunks.
 void TAlloc_free(void *ptr) {
-	if (!state.initialized) return;
-	talloc_arena_t *arena = TAlloc_find_arena(ptr);
-	if (!arena) return;
+	if (!TAlloc_is_initialized()) return;
+	TAlloc_tick_pressure();
+	TAlloc_lock(&state.lock);
+	TAlloc_free_unlocked(ptr);
+	TAlloc_unlock(&state.lock);
+}
 
-	talloc_header_t *header = (talloc_header_t *) ptr - 1;
-	if (header->magic != TALLOC_MAGIC) {
-		return;
+#if TALLOC_THREADS
+// Free a chain of blocks linked through their first word, with the lock
+// held. They go straight back to the heap, past the thread cache. Returns
+// how many there were.
+size_t TAlloc_free_chain(void *block) {
+	char uncached = talloc_tcache.uncached;
+	size_t n = 0;
+	talloc_tcache.uncached = 1;
+	for (; block; ++n) {
+		void *next = *(void **) block;
+		TAlloc_free_unlocked(block);
+		block = next;
 	}
+	talloc_tcache.uncached = uncached;
+	return n;
+}
 
-	talloc_chunk_t *chunk = (talloc_chunk_t *) header;
+// Take the deferred frees that sat in the batch of a thread for
+// TALLOC_DEFER_MS or more, and do them. A thread that defers a few frees
+// and then goes quiet (or the main thread, whose cache is never destroyed)
+// would keep them forever otherwise. Called by the reclaimer, with the
+// lock held.
+void TAlloc_defer_sweep(uint64_t now) {
+	for (talloc_tcache_t *cache = __atomic_load_n(&state.caches, __ATOMIC_ACQUIRE); cache; cache = cache->next_cache) {
+		if (__atomic_exchange_n(&cache->busy, 1, __ATOMIC_ACQUIRE)) continue;
+		if (cache->deferred && now - cache->deferred_time >= TALLOC_DEFER_MS) {
+			TAlloc_free_chain(cache->deferred);
+			cache->deferred = NULL;
+			cache->ndeferred = 0;
+			__atomic_fetch_sub(&state.deferred_batches, 1, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&cache->busy, 0, __ATOMIC_RELEASE);
+	}
+}
 
-	// chunks are sorted based on their address to make coalescing easier
-	if (!arena->free_list) {
-		arena->free_list = chunk;
-		arena->free_list->next = NULL;
-		arena->max_free_space = chunk->size;
-	} else if (chunk < arena->free_list) {
-		chunk->next = arena->free_list;
-		arena->free_list = chunk;
-		TAlloc_coalesce(chunk);
-		TAlloc_adjust_space_for_new_chunk(arena, chunk);
-	} else {
-		talloc_chunk_t *insert_after = arena->free_list;
-		while (insert_after->next && insert_after->next < chunk) {
-			insert_after = insert_after->next;
+// The reclaimer thread: sleeps until deferred frees come in, then does
+// them, TALLOC_DEFER_BATCH at a time, letting go of the lock in between so
+// other threads aren't kept waiting. While threads hold batches they
+// didn't hand over, it wakes up every TALLOC_DEFER_MS to sweep up the ones
+// that waited long enough.
+void * TAlloc_reclaimer(void *arg) {
+	(void) arg;
+	talloc_tcache.uncached = 1;
+	for (;;) {
+		void *block = __atomic_exchange_n(&state.deferred, NULL, __ATOMIC_ACQUIRE);
+		if (!block) {
+			// say we're going to sleep before looking again, so that a thread
+			// handing over blocks (or starting a batch) either sees that and
+			// wakes us, or we see what it did
+			int timeout = 0;
+			pthread_mutex_lock(&state.reclaimer_mutex);
+			__atomic_store_n(&state.reclaimer_sleeping, 1, __ATOMIC_SEQ_CST);
+			while (!timeout && !__atomic_load_n(&state.deferred, __ATOMIC_SEQ_CST)) {
+				if (!__atomic_load_n(&state.deferred_batches, __ATOMIC_SEQ_CST)) {
+					pthread_cond_wait(&state.reclaimer_cond, &state.reclaimer_mutex);
+					continue;
+				}
+				struct timespec until;
+				clock_gettime(CLOCK_REALTIME, &until);
+				until.tv_nsec += TALLOC_DEFER_MS % 1000 * 1000000L;
+				until.tv_sec += TALLOC_DEFER_MS / 1000 + until.tv_nsec / 1000000000L;
+				until.tv_nsec %= 1000000000L;
+				timeout = pthread_cond_timedwait(&state.reclaimer_cond, &state.reclaimer_mutex, &until) == ETIMEDOUT;
+			}
+			__atomic_store_n(&state.reclaimer_sleeping, 0, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&state.reclaimer_mutex);
+			if (timeout) {
+				TAlloc_lock(&state.lock);
+				TAlloc_defer_sweep(TAlloc_now_ms());
+				TAlloc_unlock(&state.lock);
+			}
+			continue;
+		}
+		while (block) {
+			TAlloc_lock(&state.lock);
+			int i = 0;
+			for (; block && i < TALLOC_DEFER_BATCH; ++i) {
+				void *next = *(void **) block;
+				TAlloc_free_unlocked(block);
+				block = next;
+			}
+			TAlloc_unlock(&state.lock);
+			__atomic_fetch_sub(&state.deferred_count, i, __ATOMIC_RELAXED);
 		}
-		chunk->next = insert_after->next;
-		insert_after->next = chunk;
-		TAlloc_coalesce(chunk);
-		TAlloc_adjust_space_for_new_chunk(arena, chunk);
-		TAlloc_coalesce(insert_after);
-		TAlloc_adjust_space_for_new_chunk(arena, insert_after);
 	}
+	return NULL;
+}
 
-	// unless it's the first arena, we release the occupied space if no longer needed
-	if (arena != state.arena_head && arena->allocated == arena->max_free_space + TALLOC_ARENA_OVERHEAD) {
-		TAlloc_free_arena(arena);
+// Start the reclaimer thread, unless it's running already. Returns whether
+// it is.
+int TAlloc_start_reclaimer() {
+	if (__atomic_load_n(&state.reclaimer_started, __ATOMIC_ACQUIRE)) return 1;
+	pthread_mutex_lock(&state.reclaimer_mutex);
+	if (!state.reclaimer_started) {
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (!pthread_create(&thread, &attr, TAlloc_reclaimer, NULL)) {
+			__atomic_store_n(&state.reclaimer_started, 1, __ATOMIC_RELEASE);
+		}
+		pthread_attr_destroy(&attr);
+	}
+	int started = state.reclaimer_started;
+	pthread_mutex_unlock(&state.reclaimer_mutex);
+	return started;
+}
+
+// Wake the reclaimer up, if it's sleeping.
+void TAlloc_wake_reclaimer() {
+	if (__atomic_load_n(&state.reclaimer_sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&state.reclaimer_mutex);
+		pthread_cond_signal(&state.reclaimer_cond);
+		pthread_mutex_unlock(&state.reclaimer_mutex);
+	}
+}
+
+// Hand a batch of deferred frees, from `first` to `last`, over to the
+// reclaimer in one go. If the reclaimer is too far behind, the blocks are
+// freed right here instead, so that they don't pile up faster than it can
+// free them.
+void TAlloc_defer_handoff(void *first, void *last, size_t n) {
+	if (__atomic_load_n(&state.deferred_count, __ATOMIC_RELAXED) >= TALLOC_DEFER_MAX) {
+		TAlloc_lock(&state.lock);
+		TAlloc_free_chain(first);
+		TAlloc_unlock(&state.lock);
+		return;
 	}
+	__atomic_fetch_add(&state.deferred_count, n, __ATOMIC_RELAXED);
+	void *head = __atomic_load_n(&state.deferred, __ATOMIC_RELAXED);
+	do {
+		*(void **) last = head;
+	} while (!__atomic_compare_exchange_n(&state.deferred, &head, first, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	TAlloc_wake_reclaimer();
+}
+
+// Free the allocated memory at the given pointer later, on the reclaimer
+// thread, so that the caller pays neither for the lock nor for coalescing
+// and unmapping. Blocks are collected per thread and handed over
+// TALLOC_DEFER_BATCH at a time; a batch that doesn't fill up within
+// TALLOC_DEFER_MS is taken by the reclaimer anyway. The pointer has to come
+// from talloc, since its first word is used to chain it up right away; the
+// usual checks only happen when it's really freed.
+//
+// If the reclaimer can't be started, or the thread is past its destructor,
+// or the reclaimer is sweeping its batch right now, the memory is freed
+// right away instead. So is a block that looks like it sits in a thread
+// cache: chaining it would overwrite the cache's link, and TAlloc_free
+// rejects it properly.
+void TAlloc_free_deferred(void *ptr) {
+	if (!ptr || !TAlloc_is_initialized()) return;
+	talloc_tcache_t *cache = &talloc_tcache;
+	if (cache->exited || TAlloc_header_magic((talloc_header_t *) ptr - 1) == TALLOC_CACHED_MAGIC || !TAlloc_start_reclaimer() || __atomic_exchange_n(&cache->busy, 1, __ATOMIC_ACQUIRE)) {
+		TAlloc_free(ptr);
+		return;
+	}
+	TAlloc_tcache_register(cache);
+	int wake = 0;
+	if (!cache->deferred) {
+		cache->deferred_last = ptr;
+		cache->deferred_time = TAlloc_now_ms();
+		// the reclaimer sleeps for good while no thread holds a batch, so
+		// tell it when one starts
+		wake = !__atomic_fetch_add(&state.deferred_batches, 1, __ATOMIC_SEQ_CST);
+	}
+	*(void **) ptr = cache->deferred;
+	cache->deferred = ptr;
+	void *batch = NULL;
+	void *last = cache->deferred_last;
+	size_t n = ++cache->ndeferred;
+	if (n >= TALLOC_DEFER_BATCH) {
+		batch = cache->deferred;
+		cache->deferred = NULL;
+		cache->ndeferred = 0;
+		__atomic_fetch_sub(&state.deferred_batches, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&cache->busy, 0, __ATOMIC_RELEASE);
+
+	if (batch) TAlloc_defer_handoff(batch, last, n);
+	else if (wake) TAlloc_wake_reclaimer();
+}
+#else
+// Without threads, there's no one to hand frees to.
+void TAlloc_free_deferred(void *ptr) {
+	TAlloc_free(ptr);
+}
+#endif
+
+// Check whether an arena has a free chunk big enough for the given size,
+// looking at its descriptor. With the bins engine, the bitmap tells in
+// constant time: either a bin above the one for this size is non-empty, or
+// the first block of the bin for this size is big enough. Only the latter
+// needs to look into the arena itself.
+int TAlloc_arena_fits(talloc_arena_desc_t *desc, size_t size) {
+#if TALLOC_ENGINE == TALLOC_ENGINE_BINS
+	int index = TAlloc_bin_index(size);
+	if (index + 1 < TALLOC_BINS && desc->binmap >> (index + 1)) return 1;
+	return desc->binmap & (1ULL << index) && (desc->arena->bins[index]->size & ~TALLOC_BLOCK_FLAGS) >= size;
+#else
+	return desc->max_free_space >= size;
+#endif
 }
 
 // Find an arena that contains a free chunk big enough to accommodate
-// the given size.
+// the given size. Slab arenas have no free chunks, so they are never picked.
 talloc_arena_t * TAlloc_get_accommodating_arena(size_t size) {
-	talloc_arena_t *arena_node = state.arena_head;
-	while (arena_node && arena_node->max_free_space < size) arena_node = arena_node->next;
+	// big requests get an arena of their own, which goes away when freed
+	if (size >= state.mmap_threshold) return TAlloc_alloc_more_space(size);
+
+	talloc_arena_t *arena_node = NULL;
+	if (state.arena_policy == TALLOC_ARENA_FULLEST) {
+		// of the arenas that fit, take the one with the least space left: new
+		// allocations pile up in busy arenas, and the nearly empty ones get the
+		// chance to empty out and be released
+		size_t least_space = SIZE_MAX;
+		for (size_t i = 0; i < state.narenas; ++i) {
+			talloc_arena_desc_t *desc = &state.arenas[i];
+			if (desc->allocated - desc->used < least_space && TAlloc_arena_fits(desc, size)) {
+				arena_node = desc->arena;
+				least_space = desc->allocated - desc->used;
+			}
+		}
+	} else {
+#if TALLOC_POLICY == TALLOC_POLICY_NEXT_FIT
+	// search from the arena the last search succeeded in to the end of
+	// the descriptors, then from the first descriptor up to that arena
+		for (size_t n = 0, i = state.arena_rover; n < state.narenas; ++n, i = i + 1 < state.narenas ? i + 1 : 0) {
+			if (TAlloc_arena_fits(&state.arenas[i], size)) {
+				arena_node = state.arenas[i].arena;
+				break;
+			}
+		}
+#else
+		for (size_t i = 0; i < state.narenas; ++i) {
+			if (TAlloc_arena_fits(&state.arenas[i], size)) {
+				arena_node = state.arenas[i].arena;
+				break;
+			}
+		}
+#endif
+	}
 	if (!arena_node) {
 		// existing arenas don't have enough free space; time to create a new one
 		arena_node = TAlloc_alloc_more_space(size);
 	}
 
+#if TALLOC_POLICY == TALLOC_POLICY_NEXT_FIT
+	if (arena_node) state.arena_rover = arena_node->index;
+#endif
 	return arena_node;
 }
 
-// Our "malloc" replacement. This is what clients will call to
-// allocate memory.
-//
-// This function will essentially
-//  - initialize the allocator state if necessary
-//  - find an arena that has a chunk big enough to accommodate the given size
-//    (or fail if not possible)
-//  - split the chunk of memory if it's bigger than necessary
-//  - update the free list of the arena
-//  - return the pointer to the allocated memory to the caller
-//
-// There are some other details in here, such as coalescing the created free
-// chunk when we split the one we found, and updating max_free_space of the
-// arena accordingly.
-void * TAlloc_malloc(size_t size) {
-	if (!state.initialized) TAlloc_initialize();
-	if (size == 0) return NULL;
-	// find the arena that contains a chunk that can accommodate this size
-	talloc_arena_t *arena = TAlloc_get_accommodating_arena(size);
+#if TALLOC_ENGINE == TALLOC_ENGINE_BINS
+// Allocate a block from the bins of an arena that fits.
+void * TAlloc_bins_malloc(size_t size) {
+	size = TAlloc_block_size_for(size);
+	if (!size) return NULL;
 
-	// oops; cannot allocate any more space :(
+	talloc_arena_t *arena = TAlloc_get_accommodating_arena(size);
 	if (!arena) return NULL;
+	talloc_block_t *block = TAlloc_bins_find(arena, size);
+	TAlloc_remove_block(arena, block);
+	return TAlloc_use_block(arena, block, size);
+}
+#endif
 
+// Find a free chunk of at least `size` bytes in the arena, according to
+// TALLOC_POLICY. The chunk before it in the free list is stored in `prev`
+// (or NULL if it's the head), so that the caller can unlink it.
+talloc_chunk_t * TAlloc_find_chunk(talloc_arena_t *arena, size_t size, talloc_chunk_t **prev) {
+#if TALLOC_POLICY == TALLOC_POLICY_NEXT_FIT
+	// search from the rover to the end of the list, then from the
+	// head of the list up to (and including) the rover
+	*prev = arena->rover;
+	talloc_chunk_t *head = *prev ? TAlloc_chunk_next(arena, *prev) : arena->free_list;
+	while (head && TAlloc_chunk_size(head) < size) {
+		*prev = head;
+		head = TAlloc_chunk_next(arena, head);
+	}
+	if (!head && arena->rover) {
+		*prev = NULL;
+		head = arena->free_list;
+		while (head && TAlloc_chunk_size(head) < size) {
+			if (head == arena->rover) return NULL;
+			*prev = head;
+			head = TAlloc_chunk_next(arena, head);
+		}
+	}
+	if (head) arena->rover = *prev;
+	return head;
+#elif TALLOC_POLICY == TALLOC_POLICY_BEST_FIT || TALLOC_POLICY == TALLOC_POLICY_BOUNDED_BEST_FIT
+	talloc_chunk_t *best = NULL, *before = NULL;
+	*prev = NULL;
+	for (talloc_chunk_t *head = arena->free_list; head; before = head, head = TAlloc_chunk_next(arena, head)) {
+		if (TAlloc_chunk_size(head) < size || (best && TAlloc_chunk_size(head) >= TAlloc_chunk_size(best))) continue;
+		best = head;
+		*prev = before;
+	#if TALLOC_POLICY == TALLOC_POLICY_BOUNDED_BEST_FIT
+		// good enough: the leftover is at most a sixteenth of the request
+		// (one TLSF second-level step), or too small to be split off. This
+		// is still a walk of the whole address-ordered list in the worst
+		// case; there are no per-class lists here.
+		if (TAlloc_chunk_size(head) - size <= (size >> TALLOC_TLSF_SL_LOG2) + sizeof(talloc_chunk_t)) break;
+	#else
+		if (TAlloc_chunk_size(head) == size) break;
+	#endif
+	}
+	return best;
+#else
 	talloc_chunk_t *head = arena->free_list;
-	talloc_chunk_t *prev = NULL;
-	while (head && head->size < size) {
-		prev = head;
-		head = head->next;
+	*prev = NULL;
+	while (head && TAlloc_chunk_size(head) < size) {
+		*prev = head;
+		head = TAlloc_chunk_next(arena, head);
 	}
+	return head;
+#endif
+}
 
-	if (!head) return NULL;
-
+#if TALLOC_ENGINE == TALLOC_ENGINE_LIST
+// Allocate the given size from a free chunk of an arena, given the free
+// chunk before it (or NULL if it's the first one). The size is that of the
+// chunk needed, from TAlloc_chunk_size_for. The chunk is split if
+// it's bigger than necessary, and the free list and max_free_space of the
+// arena are updated.
+void * TAlloc_use_chunk(talloc_arena_t *arena, talloc_chunk_t *head, talloc_chunk_t *prev, size_t size) {
 	talloc_chunk_t *next_free_chunk;
 
-	size_t excess_space = head->size - size;
+	size_t head_size = TAlloc_chunk_size(head);
+	size_t excess_space = head_size - size;
 	size_t allocated_space = size;
-	char max_free_space_affected = head->size >= arena->max_free_space;
+	talloc_arena_desc_t *desc = TAlloc_desc(arena);
+	char max_free_space_affected = head_size >= desc->max_free_space;
 
 	if (excess_space > sizeof(talloc_chunk_t)) {
 		next_free_chunk = (talloc_chunk_t *) ((void *) head + sizeof(talloc_chunk_t) + size);
 		// excess space needs to be greater than the size of the chunk header
 		// otherwise we will "take the loss"
-		next_free_chunk->size = excess_space - sizeof(talloc_chunk_t);
-		next_free_chunk->next = head->next;
-		TAlloc_coalesce(next_free_chunk);
+		TAlloc_set_chunk_size(next_free_chunk, excess_space - sizeof(talloc_chunk_t));
+		TAlloc_set_chunk_next(arena, next_free_chunk, TAlloc_chunk_next(arena, head));
+		TAlloc_coalesce(arena, next_free_chunk);
 		TAlloc_adjust_space_for_new_chunk(arena, next_free_chunk);
 		// this new chunk can potentially be bigger than current "max free space", so
 		// if we can avoid some calculations, why not do that?
-		max_free_space_affected = max_free_space_affected && head->size > next_free_chunk->size;
+		max_free_space_affected = max_free_space_affected && head_size > TAlloc_chunk_size(next_free_chunk);
 	} else {
-		next_free_chunk = head->next;
+		next_free_chunk = TAlloc_chunk_next(arena, head);
 		allocated_space += excess_space;
 	}
 
 	// initialize the header of the allocated chunk of memory
 	talloc_header_t *alloc_header = (talloc_header_t *) head;
 	alloc_header->magic = TALLOC_MAGIC;
-	alloc_header->size = allocated_space;
+	alloc_header->size = sizeof(talloc_chunk_t) + allocated_space - sizeof(talloc_header_t);
+	desc->used += sizeof(talloc_chunk_t) + allocated_space;
 
 	if (!prev) arena->free_list = next_free_chunk;
-	else arena->free_list->next = next_free_chunk;
+	else TAlloc_set_chunk_next(arena, prev, next_free_chunk);
+#if TALLOC_POLICY == TALLOC_POLICY_NEXT_FIT
+	// only TAlloc_malloc_near can take the chunk the rover is on
+	if (arena->rover == head) arena->rover = prev;
+#endif
 
 	if (max_free_space_affected) {
-		if (!arena->free_list) {
-			arena->max_free_space = 0;
-		} else {
-			talloc_chunk_t *chunk = arena->free_list;
-			arena->max_free_space = chunk->size;
-			while ((chunk = chunk->next) != NULL) {
-				if (chunk->size > arena->max_free_space) {
-					arena->max_free_space = chunk->size;
-				}
-			}
-		}
+		TAlloc_update_max_free_space(arena);
 	}
 
 	// note that the pointer points to the location
 	// right after the header :)
 	return (void *) (alloc_header + 1);
 }
+#endif
+
+// Allocate memory from the general arenas.
+//
+// This function will essentially
+//  - find an arena that has a chunk big enough to accommodate the given size
+//    (or fail if not possible)
+//  - pick one such chunk, according to the placement policy
+//  - split the chunk of memory if it's bigger than necessary
+//  - update the free list of the arena
+//  - return the pointer to the allocated memory to the caller
+//
+// There are some other details in here, such as coalescing the created free
+// chunk when we split the one we found, and updating max_free_space of the
+// arena accordingly.
+//
+// With the TLSF and bins engines, all of this is replaced by TAlloc_tlsf_malloc
+// and TAlloc_bins_malloc.
+void * TAlloc_general_malloc(size_t size) {
+#if TALLOC_ENGINE == TALLOC_ENGINE_TLSF
+	return TAlloc_tlsf_malloc(size);
+#elif TALLOC_ENGINE == TALLOC_ENGINE_BINS
+	return TAlloc_bins_malloc(size);
+#else
+	// find the arena that contains a chunk that can accommodate this size
+	size = TAlloc_chunk_size_for(size);
+	talloc_arena_t *arena = TAlloc_get_accommodating_arena(size);
+
+	// oops; cannot allocate any more space :(
+	if (!arena) return NULL;
+
+	talloc_chunk_t *prev;
+	talloc_chunk_t *head = TAlloc_find_chunk(arena, size, &prev);
+
+	if (!head) return NULL;
+
+	return TAlloc_use_chunk(arena, head, prev, size);
+#endif
+}
+
+// Allocate memory charged to the given tag. Tagged memory always comes
+// from the general arenas, whose headers can carry the tag.
+void * TAlloc_malloc_tagged(size_t size, int tag) {
+	if (!TAlloc_is_initialized()) TAlloc_initialize();
+	if (size == 0) return NULL;
+#if TALLOC_THREADS
+	if (!tag && size <= TALLOC_TCACHE_MAX && state.tcache_count) {
+		int class = (size - 1) / TALLOC_ALIGNMENT;
+		void *ptr = TAlloc_tcache_get(class);
+		if (ptr) return ptr;
+		// round up, so the block can go back to this class
+		size = (class + 1) * TALLOC_ALIGNMENT;
+	}
+#endif
+	if (tag < 0 || tag >= TALLOC_TAGS) return NULL;
+
+	void *ptr;
+	TAlloc_tick_pressure();
+	TAlloc_lock(&state.lock);
+	if (!tag) {
+#if TALLOC_THREADS
+		TAlloc_tcache_gc();
+#endif
+#if TALLOC_BUDDY
+		if (size >= TALLOC_BUDDY_MIN && size <= TALLOC_BUDDY_MAX) ptr = TAlloc_buddy_malloc(size);
+		else
+#endif
+		ptr = TAlloc_general_malloc(size);
+	} else if (!TAlloc_tag_admits(tag, size)) {
+		ptr = NULL;
+	} else {
+		ptr = TAlloc_general_malloc(size);
+		if (ptr) TAlloc_tag_charge((talloc_header_t *) ptr - 1, tag, 1);
+	}
+	TAlloc_unlock(&state.lock);
+	return ptr;
+}
+
+// Our "malloc" replacement. This is what clients will call to
+// allocate memory. It initializes the allocator state if necessary, and
+// sends medium-sized requests to the buddy arenas if they're enabled, and
+// everything else to the general arenas. The memory is charged to the
+// current tag of the calling thread, if any.
+void * TAlloc_malloc(size_t size) {
+	return TAlloc_malloc_tagged(size, talloc_current_tag);
+}
+
+// A variant of TAlloc_malloc taking TALLOC_FLAG_* flags.
+//
+// With TALLOC_FLAG_CACHELINE, the returned memory starts on a cache line
+// boundary, and no other allocation shares any of its cache lines. This is
+// useful for things like per-thread counters, which would otherwise suffer
+// from false sharing. Such allocations are never charged to a tag.
+//
+// With TALLOC_FLAG_TAG(tag), the memory is charged to the given tag rather
+// than to the current tag of the calling thread.
+void * TAlloc_mallocx(size_t size, int flags) {
+	if (!(flags & TALLOC_FLAG_CACHELINE)) {
+		int tag = TALLOC_FLAG_TAG_OF(flags);
+		return TAlloc_malloc_tagged(size, tag ? tag : talloc_current_tag);
+	}
+	if (!TAlloc_is_initialized()) TAlloc_initialize();
+	if (!TAlloc_is_initialized() || size == 0) return NULL;
+	TAlloc_lock(&state.lock);
+	void *ptr = TAlloc_slab_malloc(size);
+	TAlloc_unlock(&state.lock);
+	return ptr;
+}
+
+// Set TALLOC_OPT_* options for the heap. Arenas mapped from now on, and
+// the ones already there, are faulted in with TALLOC_OPT_POPULATE, and
+// locked with TALLOC_OPT_MLOCK (or unlocked, without it). While either
+// option is set, arenas are neither trimmed nor unmapped when they empty,
+// so pages stay warm.
+void TAlloc_set_options(int options) {
+	if (!TAlloc_is_initialized()) TAlloc_initialize();
+	TAlloc_lock(&state.lock);
+	int unlock = state.options & TALLOC_OPT_MLOCK && !(options & TALLOC_OPT_MLOCK);
+	state.options = options;
+	for (size_t i = 0; i < state.narenas; ++i) {
+		if (unlock) munlock(state.arenas[i].arena, state.arenas[i].allocated);
+		TAlloc_warm_in_use(state.arenas[i].arena, state.arenas[i].allocated, options);
+	}
+	if (state.arenas != talloc_bootstrap_arenas) {
+		if (unlock) munlock(state.arenas, state.arenas_capacity * sizeof(talloc_arena_desc_t));
+		TAlloc_warm_in_use(state.arenas, state.arenas_capacity * sizeof(talloc_arena_desc_t), options);
+	}
+	TAlloc_unlock(&state.lock);
+}
+
+// Reserve room for at least the given number of bytes of allocations up
+// front, in an arena that is faulted in right away (and locked, with
+// TALLOC_OPT_MLOCK), and is never unmapped or trimmed. Allocations on a
+// hot path then don't need to wait for the kernel. Returns 0 on success,
+// or -1 if the memory could not be mapped.
+int TAlloc_reserve(size_t bytes) {
+	if (!TAlloc_is_initialized()) TAlloc_initialize();
+	TAlloc_lock(&state.lock);
+	talloc_arena_t *arena = TAlloc_create_arena(bytes);
+	if (!arena) {
+		TAlloc_unlock(&state.lock);
+		return -1;
+	}
+	TAlloc_desc(arena)->pinned = 1;
+	if (!(state.options & TALLOC_OPT_POPULATE)) {
+		TAlloc_warm(arena, TAlloc_desc(arena)->allocated, TALLOC_OPT_POPULATE);
+		// the bootstrap arena is used first, so it needs to be warm too
+		TAlloc_warm_in_use(talloc_bootstrap, TALLOC_BOOTSTRAP_SIZE, TALLOC_OPT_POPULATE);
+	}
+	TAlloc_link_arena(arena);
+	TAlloc_unlock(&state.lock);
+	return 0;
+}
+
+// Fill in a snapshot of the heap.
+void TAlloc_stats(talloc_stats_t *stats) {
+	if (!TAlloc_is_initialized()) TAlloc_initialize();
+	TAlloc_lock(&state.lock);
+	stats->arenas = state.narenas;
+	stats->mapped = state.mapped;
+	stats->peak_mapped = state.peak_mapped;
+	stats->in_use = 0;
+	for (size_t i = 0; i < state.narenas; ++i) {
+		talloc_arena_desc_t *desc = &state.arenas[i];
+		if (desc->arena->kind != TALLOC_ARENA_GENERAL) continue;
+#if TALLOC_ENGINE == TALLOC_ENGINE_TLSF
+		// TLSF doesn't keep count, so add up the allocated blocks
+		for (talloc_block_t *block = TAlloc_first_block(desc->arena); block->size & ~TALLOC_BLOCK_FLAGS; block = TAlloc_next_block(block)) {
+			if (!(block->size & TALLOC_BLOCK_FREE)) stats->in_use += sizeof(talloc_header_t) + (block->size & ~TALLOC_BLOCK_FLAGS);
+		}
+#else
+		stats->in_use += desc->used;
+#endif
+	}
+#if TALLOC_THREADS && TALLOC_LOCK_STATS
+	stats->lock = state.lock.stats;
+#else
+	stats->lock = (talloc_lock_stats_t) { 0 };
+#endif
+	TAlloc_unlock(&state.lock);
+}
+
+// Print a summary of TAlloc_stats to stderr. With stats:true in TALLOC_CONF,
+// this runs when the program exits.
+void TAlloc_print_stats(void) {
+	talloc_stats_t stats;
+	TAlloc_stats(&stats);
+	fprintf(stderr, "talloc: %zu arenas, %zu bytes mapped (peak %zu), %zu bytes in use\n",
+		stats.arenas, stats.mapped, stats.peak_mapped, stats.in_use);
+#if TALLOC_THREADS && TALLOC_LOCK_STATS
+	fprintf(stderr, "talloc: lock taken %llu times, %llu contended, %llu spins, %llu ns waiting\n",
+		(unsigned long long) stats.lock.acquisitions, (unsigned long long) stats.lock.contended,
+		(unsigned long long) stats.lock.spins, (unsigned long long) stats.lock.wait_ns);
+#endif
+}
+
+#if TALLOC_ENGINE != TALLOC_ENGINE_LIST
+// Find a free block big enough for the given size close to the allocated
+// block at `hint`: the block right before it, if it's free, or one of the
+// TALLOC_NEAR_SCAN blocks after it.
+talloc_block_t * TAlloc_find_near(talloc_arena_t *arena, size_t size, void *hint) {
+	(void) arena;
+	talloc_block_t *block = (talloc_block_t *) ((talloc_header_t *) hint - 1);
+	if (TAlloc_header_tag((talloc_header_t *) block) < 0 || block->size & TALLOC_BLOCK_FREE) return NULL;
+	if (block->size & TALLOC_BLOCK_PREV_FREE) {
+		talloc_block_t *prev = *((talloc_block_t **) block - 1);
+		if ((prev->size & ~TALLOC_BLOCK_FLAGS) >= size) return prev;
+	}
+	for (int i = 0; i < TALLOC_NEAR_SCAN; ++i) {
+		block = TAlloc_next_block(block);
+		size_t block_size = block->size & ~TALLOC_BLOCK_FLAGS;
+		// the sentinel ends the arena
+		if (!block_size) break;
+		if (block->size & TALLOC_BLOCK_FREE && block_size >= size) return block;
+	}
+	return NULL;
+}
+#else
+// Find the free chunk of an arena closest to `hint` that is big enough for
+// the given size, and the free chunk before it. Since the free list is
+// sorted by address, we can stop at the first chunk that fits after `hint`.
+talloc_chunk_t * TAlloc_find_near(talloc_arena_t *arena, size_t size, void *hint, talloc_chunk_t **prev) {
+	talloc_chunk_t *best = NULL, *before = NULL;
+	size_t best_distance = SIZE_MAX;
+	for (talloc_chunk_t *chunk = arena->free_list; chunk; before = chunk, chunk = TAlloc_chunk_next(arena, chunk)) {
+		if (TAlloc_chunk_size(chunk) < size) continue;
+		size_t distance = (void *) chunk < hint ? hint - (void *) chunk : (void *) chunk - hint;
+		if (distance < best_distance) {
+			best = chunk;
+			best_distance = distance;
+			*prev = before;
+		}
+		if ((void *) chunk > hint) break;
+	}
+	return best;
+}
+#endif
+
+// Allocate memory close to an existing allocation, preferably in the same
+// pages, so that things like list or tree nodes that are used together
+// share pages (and TLB entries). If there's no free space near `hint`, this
+// is just TAlloc_malloc.
+void * TAlloc_malloc_near(size_t size, void *hint) {
+	if (!TAlloc_is_initialized()) TAlloc_initialize();
+	if (size == 0) return NULL;
+	int tag = talloc_current_tag;
+#if TALLOC_BUDDY
+	if (!tag && size >= TALLOC_BUDDY_MIN && size <= TALLOC_BUDDY_MAX) return TAlloc_malloc_tagged(size, 0);
+#endif
+	void *ptr = NULL;
+	TAlloc_lock(&state.lock);
+	if (tag && !TAlloc_tag_admits(tag, size)) {
+		TAlloc_unlock(&state.lock);
+		return NULL;
+	}
+	talloc_arena_t *arena = hint ? TAlloc_find_arena(hint) : NULL;
+	if (arena && arena->kind == TALLOC_ARENA_GENERAL) {
+#if TALLOC_ENGINE != TALLOC_ENGINE_LIST
+		size_t block_size = TAlloc_block_size_for(size);
+		talloc_block_t *block = block_size ? TAlloc_find_near(arena, block_size, hint) : NULL;
+		if (block) {
+			TAlloc_remove_block(arena, block);
+			ptr = TAlloc_use_block(arena, block, block_size);
+		}
+#else
+		talloc_chunk_t *prev;
+		size_t chunk_size = TAlloc_chunk_size_for(size);
+		talloc_chunk_t *head = TAlloc_find_near(arena, chunk_size, hint, &prev);
+		if (head) ptr = TAlloc_use_chunk(arena, head, prev, chunk_size);
+#endif
+	}
+	if (!ptr) ptr = TAlloc_general_malloc(size);
+	if (ptr && tag) TAlloc_tag_charge((talloc_header_t *) ptr - 1, tag, 1);
+	TAlloc_unlock(&state.lock);
+	return ptr;
+}
+
+// Allocate `n` objects of the given sizes next to each other, from a single
+// chunk that is split into `n` allocated chunks, and store their addresses
+// in `out`. Related objects then share pages and cache lines, but each one
+// is still freed on its own with TAlloc_free. Returns `out`, or NULL if the
+// memory could not be allocated.
+void ** TAlloc_independent_comalloc(size_t n, size_t sizes[], void *out[]) {
+	if (!TAlloc_is_initialized()) TAlloc_initialize();
+	if (n == 0) return NULL;
+
+	// the total size covers the objects and the headers of all but the first
+	size_t total = 0;
+	for (size_t i = 0; i < n; ++i) {
+#if TALLOC_ENGINE != TALLOC_ENGINE_LIST
+		size_t size = TAlloc_block_size_for(sizes[i]);
+		if (!size) return NULL;
+#else
+		// with chunk offsets, every chunk must stay a whole number of granules
+		size_t size = TAlloc_chunk_size_for(sizes[i]) + sizeof(talloc_chunk_t) - sizeof(talloc_header_t);
+#endif
+		if (i > 0) size += sizeof(talloc_header_t);
+		if (total + size < total) return NULL;
+		total += size;
+	}
+
+	int tag = talloc_current_tag;
+
+	// this goes to the general arenas even if it would fit a buddy block,
+	// since only general chunks can be split
+	TAlloc_lock(&state.lock);
+	void *ptr = tag && !TAlloc_tag_admits(tag, total) ? NULL : TAlloc_general_malloc(total);
+	if (!ptr) {
+		TAlloc_unlock(&state.lock);
+		return NULL;
+	}
+
+	talloc_header_t *header = (talloc_header_t *) ptr - 1;
+#if TALLOC_ENGINE != TALLOC_ENGINE_LIST
+	// the first block inherits the flags of the whole block, which is
+	// allocated, so the others have none
+	void *end = ptr + (header->size & ~TALLOC_BLOCK_FLAGS);
+	size_t flags = header->size & TALLOC_BLOCK_FLAGS;
+#else
+	void *end = ptr + header->size;
+	size_t flags = 0;
+#endif
+	for (size_t i = 0; i < n; ++i) {
+		out[i] = (void *) (header + 1);
+#if TALLOC_ENGINE != TALLOC_ENGINE_LIST
+		size_t size = TAlloc_block_size_for(sizes[i]);
+#else
+		size_t size = TAlloc_chunk_size_for(sizes[i]) + sizeof(talloc_chunk_t) - sizeof(talloc_header_t);
+#endif
+		// the last object takes whatever is left
+		if (i == n - 1) size = end - out[i];
+		header->size = size | flags;
+		TAlloc_set_header_magic(header, TALLOC_HEADER_MAGIC);
+		if (tag) TAlloc_tag_charge(header, tag, 1);
+		header = (talloc_header_t *) (out[i] + size);
+		flags = 0;
+	}
+	TAlloc_unlock(&state.lock);
+	return out;
+}
+
+// Create an allocation context, as a child of the given one, or as a root
+// if `parent` is NULL.
+talloc_ctx_t * TAlloc_ctx_new(talloc_ctx_t *parent) {
+	talloc_ctx_t *ctx = TAlloc_malloc(sizeof(talloc_ctx_t));
+	if (!ctx) return NULL;
+	ctx->parent = parent;
+	ctx->children = NULL;
+	ctx->prev = NULL;
+	ctx->next = parent ? parent->children : NULL;
+	if (ctx->next) ctx->next->prev = ctx;
+	if (parent) parent->children = ctx;
+	ctx->runs = NULL;
+	ctx->bump = NULL;
+	ctx->end = NULL;
+	return ctx;
+}
+
+// Allocate memory in a context. Requests are carved from the first run of
+// the context, and a new run is started when it's full. Requests bigger than
+// half a run get a run of their own, which goes behind the first one so we
+// keep carving from it.
+void * TAlloc_ctx_malloc(talloc_ctx_t *ctx, size_t size) {
+	if (size == 0) return NULL;
+	if (size > TALLOC_CTX_RUN_SIZE / 2) {
+		size_t run_size = sizeof(talloc_ctx_run_t) + TALLOC_ALIGNMENT - 1 + size;
+		if (run_size < size) return NULL;
+		talloc_ctx_run_t *run = TAlloc_malloc(run_size);
+		if (!run) return NULL;
+		if (ctx->runs) {
+			run->next = ctx->runs->next;
+			ctx->runs->next = run;
+		} else {
+			run->next = NULL;
+			ctx->runs = run;
+		}
+		return (void *) TALLOC_ALIGN_UP((uintptr_t) (run + 1));
+	}
+
+	void *ptr = (void *) TALLOC_ALIGN_UP((uintptr_t) ctx->bump);
+	if (!ctx->bump || ptr + size > ctx->end) {
+		talloc_ctx_run_t *run = TAlloc_malloc(TALLOC_CTX_RUN_SIZE);
+		if (!run) return NULL;
+		run->next = ctx->runs;
+		ctx->runs = run;
+		ctx->end = (void *) run + TALLOC_CTX_RUN_SIZE;
+		ptr = (void *) TALLOC_ALIGN_UP((uintptr_t) (run + 1));
+	}
+	ctx->bump = ptr + size;
+	return ptr;
+}
+
+// Free a context, along with everything allocated in it and in all of its
+// descendants. This costs a TAlloc_free per run, not per object.
+void TAlloc_ctx_free(talloc_ctx_t *ctx) {
+	while (ctx->children) TAlloc_ctx_free(ctx->children);
+
+	talloc_ctx_run_t *run = ctx->runs;
+	while (run) {
+		talloc_ctx_run_t *next = run->next;
+		TAlloc_free(run);
+		run = next;
+	}
+
+	if (ctx->prev) ctx->prev->next = ctx->next;
+	else if (ctx->parent) ctx->parent->children = ctx->next;
+	if (ctx->next) ctx->next->prev = ctx->prev;
+	TAlloc_free(ctx);
+}
 
 // A helper function that prints what the heap looks like
 // at a certain point in time.
 void TAlloc_debug_print() {
-	if (!state.initialized) {
+	if (!TAlloc_is_initialized()) {
 		printf("TAlloc is not yet initialized\n");
 		return;
 	}
+	TAlloc_lock(&state.lock);
 	talloc_arena_t *arena = state.arena_head;
 	while (arena) {
+		if (arena->kind == TALLOC_ARENA_SLAB) {
+			talloc_slab_arena_t *slab_arena = (talloc_slab_arena_t *) (arena + 1);
+			printf("Slab arena at %p, %lu bytes, %lu slabs, %lu unused\n",
+				arena, TAlloc_desc(arena)->allocated, slab_arena->nslabs, slab_arena->nunused);
+			talloc_slab_t *slab = (talloc_slab_t *) (slab_arena + 1);
+			for (size_t i = 0; i < slab_arena->nslabs; ++i, ++slab) {
+				if (!slab->cls) continue;
+				printf("  Slab at %p, %lu objects of %lu bytes, %lu in use\n",
+					slab->base, slab->cls->objects, slab->cls->size, slab->inuse);
+			}
+			arena = arena->next;
+			continue;
+		}
+		if (arena->kind == TALLOC_ARENA_BUDDY) {
+			talloc_buddy_arena_t *buddy_arena = (talloc_buddy_arena_t *) (arena + 1);
+			printf("Buddy arena at %p, %lu bytes, %lu pages used\n",
+				arena, TAlloc_desc(arena)->allocated, buddy_arena->used);
+			size_t index = 0;
+			while (index < buddy_arena->npages) {
+				size_t order = buddy_arena->orders[index] & ~TALLOC_BUDDY_FREE;
+				printf("  %s block at %p, %lu bytes\n",
+					buddy_arena->orders[index] & TALLOC_BUDDY_FREE ? "Free" : "Allocated",
+					buddy_arena->pool + index * state.pagesize, state.pagesize << order);
+				index += (size_t) 1 << order;
+			}
+			arena = arena->next;
+			continue;
+		}
 		printf("Arena at %p, %lu bytes, %lu reserved\n",
-			arena, arena->allocated, sizeof(talloc_arena_t));
+			arena, TAlloc_desc(arena)->allocated, sizeof(talloc_arena_t));
+#if TALLOC_ENGINE != TALLOC_ENGINE_LIST
+		// blocks know whether they are free, so no guessing here
+		talloc_block_t *block = TAlloc_first_block(arena);
+		while (block->size & ~TALLOC_BLOCK_FLAGS) {
+			printf("  %s chunk at %p, %lu bytes, %lu reserved\n",
+				block->size & TALLOC_BLOCK_FREE ? "Free" : "Allocated",
+				block, block->size & ~TALLOC_BLOCK_FLAGS, sizeof(talloc_header_t));
+			block = TAlloc_next_block(block);
+		}
+#else
 		void *ptr = (void *) (arena + 1);
-		while (ptr < (void *) arena + arena->allocated) {
+		while (ptr < (void *) arena + TAlloc_desc(arena)->allocated) {
 			talloc_header_t *header = (talloc_header_t *) ptr;
-			if (header->magic == TALLOC_MAGIC) {
-				printf("  Allocated chunk at %p, %lu bytes, %lu reserved\n",
-					header, header->size, sizeof(talloc_header_t));
+			if (TAlloc_header_tag(header) >= 0 || TAlloc_header_magic(header) == TALLOC_CACHED_MAGIC) {
+				printf("  %s chunk at %p, %lu bytes, %lu reserved\n",
+					TAlloc_header_tag(header) >= 0 ? "Allocated" : "Cached", header, header->size, sizeof(talloc_header_t));
 				ptr += sizeof(talloc_header_t) + header->size;
 			} else {
 				talloc_chunk_t *chunk = (talloc_chunk_t *) ptr;
 				printf("  Free chunk at %p, %lu bytes, %lu reserved\n",
-					chunk, chunk->size, sizeof(talloc_chunk_t));
-				ptr += sizeof(talloc_chunk_t) + chunk->size;
+					chunk, TAlloc_chunk_size(chunk), sizeof(talloc_chunk_t));
+				ptr += sizeof(talloc_chunk_t) + TAlloc_chunk_size(chunk);
 			}
 		}
+#endif
 		arena = arena->next;
 	}
+	TAlloc_unlock(&state.lock);
 }
 
 #endif